@@ -1,9 +1,25 @@
-#include <getopt.h>  // getopt, optarg
+#include <getopt.h>  // getopt, getopt_long, optarg
 #include <stdlib.h>  // exit, atoi, malloc, free
 #include <stdio.h>   // printf, fprintf, stderr, fopen, fclose, FILE
-#include <limits.h>  // ULONG_MAX
+#include <limits.h>  // ULONG_MAX, UINT_MAX
 #include <string.h>  // strcmp, strerror
 #include <errno.h>   // errno
+#include <stdint.h>  // uint8_t
+#include <math.h>    // log, sqrt
+#include <stddef.h>  // offsetof
+#include <fcntl.h>   // open
+#include <unistd.h>  // close
+#include <pthread.h> // pthread_create, pthread_join
+#include <sys/mman.h>  // mmap, munmap
+#include <sys/stat.h>  // fstat
+#include <sys/resource.h>  // getrusage
+#include <time.h>    // timespec_get
+#if defined(CSIM_PROFILE) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>  // __rdtsc
+#endif
+
+#include "csim_shm.h"
+#include "kernels.h"
 
 /* fast base-2 integer logarithm */
 #define INT_LOG2(x) (31 - __builtin_clz(x))
@@ -12,6 +28,13 @@
 /* tag_bits = ADDRESS_LENGTH - set_bits - block_bits */
 #define ADDRESS_LENGTH 64
 
+/* Line metadata bits, see the cache data structures below */
+#define META_VALID 1
+#define META_DIRTY 2
+#define META_RECENCY_SHIFT 2
+#define META_RECENCY(m) ((m) >> META_RECENCY_SHIFT)
+#define MAX_K ((1 << (16 - META_RECENCY_SHIFT)) - 1)
+
 /**
  * Print program usage (no need to modify).
  */
@@ -23,11 +46,57 @@ static void print_usage() {
     printf("  -S <num>     Number of sets.           (must be > 0)\n");
     printf("  -K <num>     Number of lines per set.  (must be > 0)\n");
     printf("  -B <num>     Number of bytes per line. (must be > 0)\n");
-    printf("  -p <policy>  Eviction policy. (one of 'FIFO', 'LRU')\n");
-    printf("  -t <file>    Trace file.\n\n");
+    printf("  -p <policy>  Eviction policy. (one of 'FIFO', 'LRU', 'OPT')\n");
+    printf("  -t <file>    Trace file. (repeat to share the cache among several traces)\n");
+    printf("  --interval <num>         Emit hits/misses/evictions every <num> accesses.\n");
+    printf("  --interval-instr <num>   Emit window stats every <num> instructions (I records).\n");
+    printf("  --interval-format <fmt>  Window output format. (one of 'csv', 'bin')\n");
+    printf("  --interval-out <file>    Window output file. (default: stdout, csv only)\n");
+    printf("  --icache <S,K,B[,policy]>  Add an L1 instruction cache fed by I records.\n");
+    printf("  --l2 <S,K,B[,policy]>      Add a unified L2 behind the L1 caches.\n");
+    printf("  --sector <num>           Split L1D lines into independently valid <num>-byte sectors.\n");
+    printf("  --timing                 Estimate cycles and AMAT of the data accesses.\n");
+    printf("  --hit-latency <num>      L1D hit latency in cycles.          (default: 4)\n");
+    printf("  --l2-latency <num>       Extra cycles of an L2 hit.          (default: 12)\n");
+    printf("  --mem-latency <num>      Extra cycles of a memory access.    (default: 100)\n");
+    printf("  --mshrs <num>            Outstanding L1D misses.             (default: 8)\n");
+    printf("  --issue-width <num>      Data accesses issued per cycle.     (default: 1)\n");
+    printf("  --wss                    Estimate distinct lines and pages touched (also per window).\n");
+    printf("  --mrc <rate>             Print a sampled LRU miss-ratio curve, sampling lines at <rate>.\n");
+    printf("  --mrc-max <num>          Lines kept by --mrc before the rate is lowered. (default: 8192)\n");
+    printf("  --top <num>              Report the <num> most-missed lines and most-evicting sets.\n");
+    printf("  --kernel <name>          Simulate a built-in kernel instead of a trace. (one of:\n");
+    printf("                           %s)\n", kernel_names);
+    printf("  --n <num>                Matrix dimension of --kernel.       (default: 128, at most %d)\n", KERNEL_MAX_N);
+    printf("  --tile <num>             Tile size of tiled kernels.         (default: 8)\n");
+    printf("  --autotune               Search the tile size with the fewest L1D misses.\n");
+    printf("  --interleave <order>     Order of several traces. (one of 'rr', 'time'; default: rr)\n");
+    printf("  --way-mask <m1,m2,...>   Hex masks of the L1D ways each trace may fill.\n");
+    printf("  --index-out <file>       Write a per-set index of the trace for S and B, then exit.\n");
+    printf("  --index <file>           Replay an index written by --index-out instead of a trace.\n");
+    printf("  --sets <first-last>      Replay only these sets of the index.\n");
+    printf("  --threads <num>          Threads replaying the index.        (default: 1)\n");
+    printf("  --profile                Report where the run spent its time (on stderr;\n");
+    printf("                           needs a build with make PROFILE=1).\n");
+    printf("  --shm <name>             Simulate records pushed to a csim_shm ring instead of a trace\n");
+    printf("                           (not with -p OPT, which needs the whole trace in memory).\n");
+    printf("  --format <fmt>           Trace format. (one of 'auto', 'lackey', 'drmemtrace', 'pin';\n");
+    printf("                           default: auto)\n");
+    printf("  --set-hash <fn>          L1D set index. (one of 'bits', 'xor', 'prime' (S prime),\n");
+    printf("                           'skew' (a hash per way); default: bits)\n");
+    printf("  --regions <file|auto>    Count L1D hits, misses and evictions per address region,\n");
+    printf("                           from '<name> <first> <last>' hex lines or by clustering.\n\n");
     printf("Examples:\n");
     printf("  $ ./csim    -S 16  -K 1 -B 16 -p LRU -t traces/yi.trace\n");
     printf("  $ ./csim -v -S 256 -K 2 -B 16 -p LRU -t traces/yi.trace\n");
+    printf("  $ ./csim -S 16 -K 2 -B 16 -p LRU --interval 1000 -t traces/long.trace\n");
+    printf("  $ ./csim -S 64 -K 8 -B 64 -p LRU --icache 64,8,64 --l2 1024,16,64 -t traces/trans.trace\n");
+    printf("  $ ./csim -S 16 -K 4 -B 64 -p LRU --mrc 0.01 -t traces/long.trace\n");
+    printf("  $ ./csim -S 64 -K 8 -B 64 -p LRU --kernel matmul-tiled --n 96 --autotune\n");
+    printf("  $ ./csim -S 64 -K 8 -B 64 -p LRU -t traces/long.trace -t traces/trans.trace --way-mask f0,0f\n");
+    printf("  $ ./csim -S 64 -B 64 --index-out long.idx -t traces/long.trace\n");
+    printf("  $ ./csim -S 64 -K 8 -B 64 -p LRU --index long.idx --threads 4\n");
+    printf("  $ ./csim -S 16 -K 4 -B 16 -p LRU --regions auto -t traces/long.trace\n");
     exit(0);
 }
 
@@ -39,55 +108,329 @@ int B = 0;         // bytes per line
 int blockOffsetBit = 0;    // log2(B)
 int setIndexBit = 0;    // log2(S)
 
-typedef enum { FIFO = 1, LRU = 2 } Policy;
+typedef enum { FIFO = 1, LRU = 2, OPT = 3 } Policy;
 Policy policy;     // 0 (undefined) by default
 
+/* L1D set index function (--set-hash), see set_index */
+typedef enum { HASH_BITS = 0, HASH_XOR, HASH_PRIME, HASH_SKEW } SetHash;
+SetHash setHash = HASH_BITS;
+
+/* Geometry of an optional extra cache level (--icache, --l2), S == 0 if unused */
+typedef struct {
+    int S;
+    int K;
+    int B;
+    Policy policy;
+} LevelSpec;
+
+LevelSpec icache_spec;
+LevelSpec l2_spec;
+
+int sectorSize = 0;     // bytes per L1D sector, 0 if lines are not sectored
+
+int wss = 0;            // estimate working-set sizes (--wss)
+
+/* Sampled miss-ratio curve parameters (--mrc), 0 rate if disabled */
+double mrcRate = 0.0;
+unsigned long mrcMax = 8192;
+
+unsigned long topN = 0;         // entries of the --top report, 0 if disabled
+
+const char *region_path = NULL; // region map file or "auto" (--regions), NULL if disabled
+
+/* Built-in kernel replacing the trace (--kernel), NULL if disabled */
+const Kernel *workload = NULL;
+int kernelN = 128;
+int kernelTile = 8;
+int autotune = 0;
+
+/* Timing model parameters (--timing and friends), in cycles */
+int timing = 0;
+unsigned long hitLatency = 4;
+unsigned long l2Latency = 12;
+unsigned long memLatency = 100;
+unsigned long mshrCount = 8;
+unsigned long issueWidth = 1;
+
 FILE *trace_fp = NULL;
 
+/**
+ * Traces sharing the cache (one `-t` each). `--interleave rr` takes one record
+ * from each stream in turn; `--interleave time` always advances the stream
+ * with the smallest instruction count, where each I record is an instruction
+ * (or each data record, in traces without I records).
+ */
+#define MAX_STREAMS 16
+
+typedef enum { FORMAT_AUTO = 0, FORMAT_LACKEY, FORMAT_DRMEMTRACE, FORMAT_PIN } TraceFormat;
+
+typedef enum { INTERLEAVE_RR = 1, INTERLEAVE_TIME = 2 } Interleave;
+
+typedef struct {
+    FILE *fp;
+    struct Decoder *dec;        // decodes `fp`
+    const char *path;
+    unsigned long clock;        // instructions replayed
+    int seen_instr;             // 1 once an I record was read
+    int done;
+    unsigned long mask;         // L1D ways this stream may fill
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long evicted;      // lines of this stream evicted by other streams
+} Stream;
+
+Stream streams[MAX_STREAMS];
+int nstreams = 0;
+int current_stream = 0;
+Interleave interleave = INTERLEAVE_RR;
+int way_masks = 0;              // 1 if --way-mask restricts fills
+TraceFormat trace_format = FORMAT_AUTO;  // format of every trace (--format)
+
+/* Live trace from a shared-memory ring (--shm), NULL if disabled */
+const char *shm_name = NULL;
+CsimShm *shm_ring = NULL;
+
+/* Trace index (--index-out, --index), NULL paths if disabled */
+const char *index_out = NULL;
+const char *index_in = NULL;
+unsigned long index_first = 0;
+unsigned long index_last = ULONG_MAX;
+unsigned long threads = 1;
+
+/**
+ * Self-profiling (--profile).
+ *
+ * Phases are timed with the TSC (converted to seconds against the wall clock
+ * of the whole run) and lookups are counted in the access kernels. The timers
+ * and counters only exist in builds with `make PROFILE=1`, which defines
+ * CSIM_PROFILE, as the lookup counter sits in the hottest path.
+ */
+int profile = 0;
+
+typedef struct {
+    unsigned long parse;        // ticks reading and decoding records
+    unsigned long simulate;     // ticks simulating them
+} Profile;
+
+Profile prof;
+_Thread_local unsigned long prof_lookups = 0;  // kernel calls of this thread
+_Thread_local unsigned long prof_ways = 0;     // ways they compared
+
+#ifdef CSIM_PROFILE
+static inline unsigned long profile_ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+#endif
+}
+
+#define PROFILE_COUNT(stmt) do { if (profile) { stmt; } } while (0)
+/* Declare lap timer `t`, then add the ticks since the last lap to `acc` */
+#define PROFILE_START(t) unsigned long t = profile ? profile_ticks() : 0
+#define PROFILE_LAP(acc, t)                        \
+    do {                                           \
+        if (profile) {                             \
+            unsigned long now_ = profile_ticks();  \
+            (acc) += now_ - (t);                   \
+            (t) = now_;                            \
+        }                                          \
+    } while (0)
+#else
+#define PROFILE_COUNT(stmt) do { } while (0)
+#define PROFILE_START(t) do { } while (0)
+#define PROFILE_LAP(acc, t) do { } while (0)
+#endif
+
+/* Windowed time-series output (--interval, --interval-instr) */
+typedef enum { WINDOW_CSV = 1, WINDOW_BIN = 2 } WindowFormat;
+unsigned long window_len = 0;       // window length, 0 if disabled
+int window_by_instr = 0;            // 1 if windows count I records, not accesses
+WindowFormat window_format = WINDOW_CSV;
+FILE *window_fp = NULL;
+
+/* Long-only options are numbered above the range of short option chars */
+enum {
+    OPT_INTERVAL = 256,
+    OPT_INTERVAL_INSTR,
+    OPT_INTERVAL_FORMAT,
+    OPT_INTERVAL_OUT,
+    OPT_ICACHE,
+    OPT_L2,
+    OPT_SECTOR,
+    OPT_TIMING,
+    OPT_HIT_LATENCY,
+    OPT_L2_LATENCY,
+    OPT_MEM_LATENCY,
+    OPT_MSHRS,
+    OPT_ISSUE_WIDTH,
+    OPT_WSS,
+    OPT_MRC,
+    OPT_MRC_MAX,
+    OPT_TOP,
+    OPT_KERNEL,
+    OPT_N,
+    OPT_TILE,
+    OPT_AUTOTUNE,
+    OPT_INTERLEAVE,
+    OPT_WAY_MASK,
+    OPT_INDEX_OUT,
+    OPT_INDEX,
+    OPT_SETS,
+    OPT_THREADS,
+    OPT_PROFILE,
+    OPT_SHM,
+    OPT_FORMAT,
+    OPT_SET_HASH,
+    OPT_REGIONS,
+};
+
+static const struct option long_options[] = {
+    {"interval",        required_argument, NULL, OPT_INTERVAL},
+    {"interval-instr",  required_argument, NULL, OPT_INTERVAL_INSTR},
+    {"interval-format", required_argument, NULL, OPT_INTERVAL_FORMAT},
+    {"interval-out",    required_argument, NULL, OPT_INTERVAL_OUT},
+    {"icache",          required_argument, NULL, OPT_ICACHE},
+    {"l2",              required_argument, NULL, OPT_L2},
+    {"sector",          required_argument, NULL, OPT_SECTOR},
+    {"timing",          no_argument,       NULL, OPT_TIMING},
+    {"hit-latency",     required_argument, NULL, OPT_HIT_LATENCY},
+    {"l2-latency",      required_argument, NULL, OPT_L2_LATENCY},
+    {"mem-latency",     required_argument, NULL, OPT_MEM_LATENCY},
+    {"mshrs",           required_argument, NULL, OPT_MSHRS},
+    {"issue-width",     required_argument, NULL, OPT_ISSUE_WIDTH},
+    {"wss",             no_argument,       NULL, OPT_WSS},
+    {"mrc",             required_argument, NULL, OPT_MRC},
+    {"mrc-max",         required_argument, NULL, OPT_MRC_MAX},
+    {"top",             required_argument, NULL, OPT_TOP},
+    {"kernel",          required_argument, NULL, OPT_KERNEL},
+    {"n",               required_argument, NULL, OPT_N},
+    {"tile",            required_argument, NULL, OPT_TILE},
+    {"autotune",        no_argument,       NULL, OPT_AUTOTUNE},
+    {"interleave",      required_argument, NULL, OPT_INTERLEAVE},
+    {"way-mask",        required_argument, NULL, OPT_WAY_MASK},
+    {"index-out",       required_argument, NULL, OPT_INDEX_OUT},
+    {"index",           required_argument, NULL, OPT_INDEX},
+    {"sets",            required_argument, NULL, OPT_SETS},
+    {"threads",         required_argument, NULL, OPT_THREADS},
+    {"profile",         no_argument,       NULL, OPT_PROFILE},
+    {"shm",             required_argument, NULL, OPT_SHM},
+    {"format",          required_argument, NULL, OPT_FORMAT},
+    {"set-hash",        required_argument, NULL, OPT_SET_HASH},
+    {"regions",         required_argument, NULL, OPT_REGIONS},
+    {NULL, 0, NULL, 0}
+};
+
+/* Parse a strictly positive decimal count, exit with error otherwise */
+static unsigned long parse_count(const char *name, const char *arg) {
+    char *end;
+    errno = 0;
+    unsigned long n = strtoul(arg, &end, 10);
+    if (errno || *end != '\0' || *arg == '-' || n == 0) {
+        fprintf(stderr, "ERROR: %s must be a positive integer\n", name);
+        exit(1);
+    }
+    return n;
+}
+
+/* Parse a sampling rate in (0, 1], exit with error otherwise */
+static double parse_rate(const char *name, const char *arg) {
+    char *end;
+    errno = 0;
+    double r = strtod(arg, &end);
+    if (errno || *end != '\0' || !(r > 0.0 && r <= 1.0)) {
+        fprintf(stderr, "ERROR: %s must be a rate in (0, 1]\n", name);
+        exit(1);
+    }
+    return r;
+}
+
+/* Parse a replacement policy name, exit with error if unknown */
+static Policy parse_policy(const char *name) {
+    if (!strcmp(name, "FIFO"))
+        return FIFO;
+    if (!strcmp(name, "LRU"))
+        return LRU;
+    if (!strcmp(name, "OPT"))
+        return OPT;
+    fprintf(stderr, "ERROR: Unknown policy\n");
+    exit(1);
+}
+
+/* Parse `S,K,B[,policy]` of an extra cache level; the policy defaults to LRU */
+static void parse_level(const char *name, const char *arg, LevelSpec *spec) {
+    char policy_name[8] = "LRU";
+    int n = sscanf(arg, "%d,%d,%d,%7s", &spec->S, &spec->K, &spec->B, policy_name);
+    if (n < 3 || spec->S <= 0 || spec->K <= 0 || spec->B <= 0) {
+        fprintf(stderr, "ERROR: %s expects S,K,B[,policy] with positive numbers\n", name);
+        exit(1);
+    }
+    if (NOT_POWER2(spec->S) || NOT_POWER2(spec->B)) {
+        fprintf(stderr, "ERROR: %s S and B must be powers of 2\n", name);
+        exit(1);
+    }
+    if (spec->K > MAX_K) {
+        fprintf(stderr, "ERROR: %s K must be at most %d\n", name, MAX_K);
+        exit(1);
+    }
+    spec->policy = parse_policy(policy_name);
+    if (spec->policy == OPT) {
+        // OPT plans next uses of the trace, which only the L1 data cache sees
+        fprintf(stderr, "ERROR: %s does not support OPT\n", name);
+        exit(1);
+    }
+}
+
 /**
  * Parse input arguments and set verbose, S, K, B, policy, trace_fp.
  *
  * TODO: Finish implementation
  */
 static void parse_arguments(int argc, char **argv) {
-    char c;
-    while ((c = getopt(argc, argv, "S:K:B:p:t:vh")) != -1) {
+    int c;
+    const char *window_path = NULL;
+    const char *mask_list = NULL;
+    while ((c = getopt_long(argc, argv, "S:K:B:p:t:vh", long_options, NULL)) != -1) {
         switch(c) {
             case 'S':
-                S = atoi(optarg);
-                if (NOT_POWER2(S)) {
-                    fprintf(stderr, "ERROR: S must be a power of 2\n");
-                    exit(1);
-                }
+                S = atoi(optarg);  // checked below, prime-modulo indexing needs no power of 2
                 break;
             case 'K':
                 // TODO
                 K = atoi(optarg);
+                if (K > MAX_K) {
+                    fprintf(stderr, "ERROR: K must be at most %d\n", MAX_K);
+                    exit(1);
+                }
                 break;
             case 'B':
                 // TODO
                 B = atoi(optarg);
-                break;
-            case 'p':
-                if (!strcmp(optarg, "FIFO")) {
-                    policy = FIFO;
-                }
-                // TODO: parse LRU, exit with error for unknown policy
-                else if (!strcmp(optarg, "LRU")){
-                    policy = LRU;
-                }
-                else{
-                    fprintf(stderr, "ERROR: Unknown policy\n");
+                if (NOT_POWER2(B)) {
+                    fprintf(stderr, "ERROR: B must be a power of 2\n");
                     exit(1);
                 }
                 break;
+            case 'p':
+                policy = parse_policy(optarg);
+                break;
             case 't':
                 // TODO: open file trace_fp for reading
-                trace_fp = fopen(optarg, "r");
-                if (!trace_fp) {
+                if (nstreams == MAX_STREAMS) {
+                    fprintf(stderr, "ERROR: at most %d traces\n", MAX_STREAMS);
+                    exit(1);
+                }
+                streams[nstreams].fp = fopen(optarg, "rb");
+                if (!streams[nstreams].fp) {
                     fprintf(stderr, "ERROR: %s: %s\n", optarg, strerror(errno));
                     exit(1);
                 }
+                streams[nstreams].path = optarg;
+                trace_fp = streams[0].fp;
+                nstreams++;
                 break;
             case 'v':
                 // TODO
@@ -97,6 +440,165 @@ static void parse_arguments(int argc, char **argv) {
                 // TODO
                 print_usage();
                 exit(0);
+            case OPT_INTERVAL:
+            case OPT_INTERVAL_INSTR:
+                if (window_len) {
+                    fprintf(stderr, "ERROR: --interval and --interval-instr are exclusive\n");
+                    exit(1);
+                }
+                window_len = parse_count("interval", optarg);
+                window_by_instr = (c == OPT_INTERVAL_INSTR);
+                break;
+            case OPT_INTERVAL_FORMAT:
+                if (!strcmp(optarg, "csv")) {
+                    window_format = WINDOW_CSV;
+                }
+                else if (!strcmp(optarg, "bin")) {
+                    window_format = WINDOW_BIN;
+                }
+                else {
+                    fprintf(stderr, "ERROR: Unknown interval format\n");
+                    exit(1);
+                }
+                break;
+            case OPT_INTERVAL_OUT:
+                window_path = optarg;
+                break;
+            case OPT_ICACHE:
+                parse_level("--icache", optarg, &icache_spec);
+                break;
+            case OPT_L2:
+                parse_level("--l2", optarg, &l2_spec);
+                break;
+            case OPT_TIMING:
+                timing = 1;
+                break;
+            case OPT_HIT_LATENCY:
+                hitLatency = parse_count("hit latency", optarg);
+                break;
+            case OPT_L2_LATENCY:
+                l2Latency = parse_count("L2 latency", optarg);
+                break;
+            case OPT_MEM_LATENCY:
+                memLatency = parse_count("memory latency", optarg);
+                break;
+            case OPT_MSHRS:
+                mshrCount = parse_count("mshrs", optarg);
+                break;
+            case OPT_ISSUE_WIDTH:
+                issueWidth = parse_count("issue width", optarg);
+                break;
+            case OPT_WSS:
+                wss = 1;
+                break;
+            case OPT_MRC:
+                mrcRate = parse_rate("mrc", optarg);
+                break;
+            case OPT_MRC_MAX:
+                mrcMax = parse_count("mrc max", optarg);
+                if (mrcMax >= UINT_MAX) {
+                    fprintf(stderr, "ERROR: mrc max must be below %u\n", UINT_MAX);
+                    exit(1);
+                }
+                break;
+            case OPT_TOP:
+                topN = parse_count("top", optarg);
+                break;
+            case OPT_KERNEL:
+                workload = find_kernel(optarg);
+                if (!workload) {
+                    fprintf(stderr, "ERROR: Unknown kernel\n");
+                    exit(1);
+                }
+                break;
+            case OPT_N:
+                kernelN = parse_count("n", optarg);
+                if (kernelN > KERNEL_MAX_N) {
+                    fprintf(stderr, "ERROR: --n must be at most %d, or the matrices overlap\n", KERNEL_MAX_N);
+                    exit(1);
+                }
+                break;
+            case OPT_TILE:
+                kernelTile = parse_count("tile", optarg);
+                break;
+            case OPT_AUTOTUNE:
+                autotune = 1;
+                break;
+            case OPT_INTERLEAVE:
+                if (!strcmp(optarg, "rr")) {
+                    interleave = INTERLEAVE_RR;
+                }
+                else if (!strcmp(optarg, "time")) {
+                    interleave = INTERLEAVE_TIME;
+                }
+                else {
+                    fprintf(stderr, "ERROR: Unknown interleave order\n");
+                    exit(1);
+                }
+                break;
+            case OPT_WAY_MASK:
+                mask_list = optarg;
+                break;
+            case OPT_INDEX_OUT:
+                index_out = optarg;
+                break;
+            case OPT_INDEX:
+                index_in = optarg;
+                break;
+            case OPT_SETS:
+                if (sscanf(optarg, "%lu-%lu", &index_first, &index_last) != 2 ||
+                    index_first > index_last) {
+                    fprintf(stderr, "ERROR: --sets expects first-last\n");
+                    exit(1);
+                }
+                break;
+            case OPT_THREADS:
+                threads = parse_count("threads", optarg);
+                break;
+            case OPT_PROFILE:
+#ifndef CSIM_PROFILE
+                fprintf(stderr, "ERROR: --profile needs a build with make PROFILE=1\n");
+                exit(1);
+#endif
+                profile = 1;
+                break;
+            case OPT_SHM:
+                shm_name = optarg;
+                break;
+            case OPT_FORMAT: {
+                static const char *names[] = {"auto", "lackey", "drmemtrace", "pin"};
+                int f = 0;
+                while (f < 4 && strcmp(optarg, names[f]))
+                    f++;
+                if (f == 4) {
+                    fprintf(stderr, "ERROR: Unknown trace format\n");
+                    exit(1);
+                }
+                trace_format = (TraceFormat)f;
+                break;
+            }
+            case OPT_SET_HASH: {
+                static const char *names[] = {"bits", "xor", "prime", "skew"};
+                int f = 0;
+                while (f < 4 && strcmp(optarg, names[f]))
+                    f++;
+                if (f == 4) {
+                    fprintf(stderr, "ERROR: Unknown set hash\n");
+                    exit(1);
+                }
+                setHash = (SetHash)f;
+                break;
+            }
+            case OPT_REGIONS:
+                region_path = optarg;
+                break;
+            case OPT_SECTOR:
+                sectorSize = atoi(optarg);
+                if (sectorSize <= 0 || NOT_POWER2(sectorSize)) {
+                    fprintf(stderr, "ERROR: sector size must be a power of 2\n");
+                    exit(1);
+                }
+                break;
             default:
                 print_usage();
                 exit(1);
@@ -104,16 +606,131 @@ static void parse_arguments(int argc, char **argv) {
     }
 
     /* Make sure that all required command line args were specified and valid */
-    if (S <= 0 || K <= 0 || B <= 0 || policy == 0) {
+    if (S <= 0 || B <= 0 || (!index_out && (K <= 0 || policy == 0))) {
         printf("ERROR: Negative or missing command line arguments\n");
         print_usage();
-        fclose(trace_fp);
+        if (trace_fp)
+            fclose(trace_fp);
+        exit(1);
+    }
+
+    if (setHash == HASH_PRIME) {
+        int prime = S > 1;
+        for (int d = 2; (long)d * d <= S && prime; d++)
+            prime = S % d != 0;
+        if (!prime) {
+            fprintf(stderr, "ERROR: --set-hash prime needs a prime S\n");
+            exit(1);
+        }
+    }
+    else if (NOT_POWER2(S)) {
+        fprintf(stderr, "ERROR: S must be a power of 2\n");
         exit(1);
     }
 
     /* Other setup if needed */
     blockOffsetBit = INT_LOG2(B);
     setIndexBit = INT_LOG2(S);
+
+    if (sectorSize && (sectorSize > B || B / sectorSize > 64)) {
+        fprintf(stderr, "ERROR: sector size must be at most B and at least B/64\n");
+        exit(1);
+    }
+    if (sectorSize && policy == OPT) {
+        fprintf(stderr, "ERROR: OPT does not support sectored lines\n");
+        exit(1);
+    }
+
+    if (workload && trace_fp) {
+        fprintf(stderr, "ERROR: --kernel and -t are exclusive\n");
+        exit(1);
+    }
+    if (workload && policy == OPT) {
+        // OPT plans next uses from a decoded trace, which kernels do not produce
+        fprintf(stderr, "ERROR: OPT does not support --kernel\n");
+        exit(1);
+    }
+    if (autotune && (!workload || !workload->tiled)) {
+        fprintf(stderr, "ERROR: --autotune needs a tiled --kernel\n");
+        exit(1);
+    }
+    if (autotune && (window_len || timing || mrcRate || wss || topN || region_path)) {
+        fprintf(stderr, "ERROR: --autotune only reports cache counters\n");
+        exit(1);
+    }
+
+    if (shm_name && (trace_fp || workload || index_in)) {
+        fprintf(stderr, "ERROR: --shm replaces -t, --kernel and --index\n");
+        exit(1);
+    }
+    if (shm_name && policy == OPT) {
+        // OPT decodes the whole trace into memory first, which a live ring is meant to avoid
+        fprintf(stderr, "ERROR: -p OPT needs the whole trace in memory and cannot read --shm\n");
+        exit(1);
+    }
+    if ((index_out || index_in) && setHash != HASH_BITS) {
+        // the index stores sets by address bits
+        fprintf(stderr, "ERROR: trace indexes need --set-hash bits\n");
+        exit(1);
+    }
+    if (setHash == HASH_SKEW && (policy == OPT || sectorSize)) {
+        fprintf(stderr, "ERROR: --set-hash skew supports FIFO and LRU without --sector\n");
+        exit(1);
+    }
+    if (index_out && ((!trace_fp && !shm_name) || index_in)) {
+        fprintf(stderr, "ERROR: --index-out needs -t\n");
+        exit(1);
+    }
+    if (index_in && (trace_fp || workload || policy == OPT || sectorSize || icache_spec.S ||
+                     l2_spec.S || window_len || timing || mrcRate || wss || topN || mask_list ||
+                     region_path)) {
+        // sets are replayed independently, so only per-set L1D state is kept
+        fprintf(stderr, "ERROR: --index replays the L1D counters of FIFO or LRU only\n");
+        exit(1);
+    }
+
+    // every stream may fill every way unless --way-mask says otherwise
+    for (int i = 0; i < nstreams; i++)
+        streams[i].mask = ~0UL;
+    if (mask_list) {
+        if (K > 64 || policy == OPT) {
+            fprintf(stderr, "ERROR: --way-mask needs K <= 64 and FIFO or LRU\n");
+            exit(1);
+        }
+        const char *p = mask_list;
+        for (int i = 0; ; i++) {
+            char *end;
+            unsigned long mask = strtoul(p, &end, 16);
+            unsigned long ways = K == 64 ? ~0UL : (1UL << K) - 1;
+            if (i >= nstreams || end == p || (*end != ',' && *end != '\0') ||
+                (mask & ways) == 0 || (mask & ~ways)) {
+                fprintf(stderr, "ERROR: --way-mask expects one non-empty mask of the K ways per trace\n");
+                exit(1);
+            }
+            streams[i].mask = mask;
+            if (*end == '\0')
+                break;
+            p = end + 1;
+        }
+        way_masks = 1;
+    }
+
+    if (window_len) {
+        if (window_path) {
+            window_fp = fopen(window_path, window_format == WINDOW_BIN ? "wb" : "w");
+            if (!window_fp) {
+                fprintf(stderr, "ERROR: %s: %s\n", window_path, strerror(errno));
+                exit(1);
+            }
+        }
+        else if (window_format == WINDOW_BIN) {
+            fprintf(stderr, "ERROR: --interval-format bin requires --interval-out\n");
+            exit(1);
+        }
+        else {
+            window_fp = stdout;
+        }
+    }
 }
 
 /**
@@ -121,53 +738,183 @@ static void parse_arguments(int argc, char **argv) {
  * TODO: Define your own!
  */
 
-typedef struct {
-    int valid;
-    unsigned long tag;
-    int usedCountLRU;
-    int orderCountFIFO;
-} setLine;
+/**
+ * A set is stored as K tags followed by K 16-bit metadata words:
+ *
+ *   bit 0      valid
+ *   bit 1      dirty (written by S/M since the line was filled)
+ *   bits 2-15  recency: K for the most recently used (LRU) or inserted (FIFO)
+ *              line of the set, down to 1 for the next victim, 0 if invalid
+ *
+ * A tag is the full line address (addr >> blockOffsetBit). Zeroed memory is an
+ * empty set, and the victim is always the way with the smallest metadata word.
+ *
+ * Sectored caches append K 64-bit sector masks (bit i set if sector i of the
+ * line holds valid data) after the metadata words, and caches shared by
+ * several traces append K bytes holding the stream that filled each line.
+ */
 
-// cacheSet is a pointer to an array of size K (lines per set) containing the line structs
-typedef struct {
-    setLine *lines;
-} cacheSet;
+/* Aim for sparse pages of about this many bytes of sets */
+#define CACHE_PAGE_BYTES 4096
 
-// cache consists of a pointer to an array of size S (no. of sets)
-typedef struct {
-    cacheSet *sets;
+struct myCache;
+
+/* Simulates an access to `line`; returns an ACCESS_* outcome */
+typedef int (*AccessKernel)(struct myCache *c, unsigned long line, int write);
+
+/**
+ * A cache level. The L1 data cache (`cache`) is configured by -S/-K/-B/-p and
+ * counts into hit_count/miss_count/eviction_count; the optional instruction
+ * cache and L2 count into their own `hits`/`misses`/... fields. Misses and
+ * writebacks are forwarded to `next` (non-inclusive, write-allocate).
+ *
+ * Sets live in pages of 2^pageShift consecutive sets. The page directory is
+ * the only eager allocation; a page is allocated zeroed the first time one of
+ * its sets is accessed, so memory grows with the sets a trace touches rather
+ * than with S*K.
+ *
+ * `setHash` picks the set of a line (see set_index). A skewed-associative
+ * cache looks each way up in its own set and keeps a timestamp per line,
+ * after the other per-set arrays, for replacement.
+ */
+typedef struct myCache {
+    const char *name;
+    int S;
+    int K;
+    int blockOffsetBit;         // log2(B)
+    Policy policy;
+    AccessKernel kernel;
+    struct myCache *next;       // next level, NULL for memory
+
+    unsigned char **pages;      // page directory, NULL until a page is touched
+    SetHash setHash;
+    unsigned long setMask;      // S - 1
+    unsigned long pageMask;     // sets per page - 1
+    int pageShift;              // log2(sets per page)
+    unsigned long npages;       // pages in the directory, rounded up for a prime S
+    size_t setBytes;            // K tags + K metadata words (+ K sector masks)
+    size_t sectorOffset;        // offset of the sector masks in a set, 0 if unsectored
+    size_t ownerOffset;         // offset of the line owners in a set, 0 if unshared
+    size_t stampOffset;         // offset of the skewed timestamps in a set, 0 if unskewed
+    unsigned long clock;        // skewed: last timestamp given out
+    unsigned long lastSet;      // skewed: set holding the line of the last access
+    int sectorBit;              // log2(sector size)
+    unsigned long pagesTouched;
+
+    int way;                    // way used by the last access
+    unsigned long victim;       // line evicted by the last access
+    unsigned long touched;      // sectored: sectors accessed (input of the kernel)
+    unsigned long fillMask;     // ways a miss may fill (input of the kernel)
+    unsigned long fetched;      // sectored: sectors fetched by the last access
+    unsigned long sectorMisses; // sectored: tag hits missing some sectors
+    unsigned long bytesFetched; // sectored: bytes brought in by misses
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long writebacks;   // evictions of dirty lines
 } myCache;
 
 //global declaration for the structs so we can void access the cache across argument calls
 myCache cache;	
-cacheSet set;
-setLine line;
+myCache icache;
+myCache l2cache;
 
 /**
  * Allocate cache data structures.
  *
- * This function dynamically allocates (with malloc) data structures for each of
- * the `S` sets and `K` lines per set.
+ * This function dynamically allocates (with malloc) the page directory of the
+ * `S` sets of `c`; pages of sets with `K` lines each are allocated on first
+ * use.
  *
  * TODO: Implement
  */
-static void allocate_cache() {
-    //dynamically allocating sets within cache
-    cache.sets = (cacheSet *) malloc(sizeof(cacheSet) * S);
-    //dynamically allocating lines withing sets
-    for (int i=0; i<S; i++) 
-    {
-        cache.sets[i].lines =  (setLine *) malloc(sizeof(setLine) * K);
-        //loop to construct the lines
-        int j = 0;
-        for (j=0; j<K; j++) 
-        {
-            cache.sets[i].lines[j].valid = 0;
-            cache.sets[i].lines[j].tag = 0;
-            cache.sets[i].lines[j].usedCountLRU = 0;
-            cache.sets[i].lines[j].orderCountFIFO = 0;
-        }
+static void allocate_cache(myCache *c, const char *name, int S, int K, int B, Policy policy,
+                           int sectorSize, int owners, SetHash setHash) {
+    memset(c, 0, sizeof(*c));
+    c->name = name;
+    c->S = S;
+    c->K = K;
+    c->blockOffsetBit = INT_LOG2(B);
+    c->policy = policy;
+    c->setBytes = ((sizeof(unsigned long) + sizeof(uint16_t)) * K + 7) & ~(size_t)7;
+    if (sectorSize) {
+        c->sectorOffset = c->setBytes;
+        c->sectorBit = INT_LOG2(sectorSize);
+        c->setBytes += sizeof(unsigned long) * K;
+    }
+    if (owners) {
+        c->ownerOffset = c->setBytes;
+        c->setBytes += ((size_t)K + 7) & ~(size_t)7;
+    }
+    c->setHash = setHash;
+    if (setHash == HASH_SKEW) {
+        c->stampOffset = c->setBytes;
+        c->setBytes += sizeof(unsigned long) * K;
+    }
+    c->fillMask = ~0UL;
+    c->setMask = S - 1;
+    while ((1UL << (c->pageShift + 1)) <= (unsigned long)S &&
+           (c->setBytes << (c->pageShift + 1)) <= CACHE_PAGE_BYTES)
+        c->pageShift++;
+    c->pageMask = (1UL << c->pageShift) - 1;
+    c->npages = ((unsigned long)S + c->pageMask) >> c->pageShift;
+    c->pages = (unsigned char **) calloc(c->npages, sizeof(unsigned char *));
+    if (c->pages == NULL) {
+        fprintf(stderr, "ERROR: out of memory\n");
+        exit(1);
+    }
+}
+
+/* Allocate the (zeroed, so empty) page of sets number `page` */
+static unsigned char *materialize_page(myCache *c, unsigned long page) {
+    c->pages[page] = (unsigned char *) calloc(c->pageMask + 1, c->setBytes);
+    if (c->pages[page] == NULL) {
+        fprintf(stderr, "ERROR: out of memory\n");
+        exit(1);
+    }
+    c->pagesTouched++;
+    return c->pages[page];
+}
+
+/* 64-bit finalizer of MurmurHash3, so nearby lines get unrelated hashes */
+static inline unsigned long hash_line(unsigned long key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdUL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53UL;
+    key ^= key >> 33;
+    return key;
+}
+
+/**
+ * Set of `line` in `c`: its low log2(S) bits (bits), the XOR of all its
+ * log2(S)-bit slices (xor), or the line modulo a prime S (prime). Skewed
+ * caches use `skew_index` instead.
+ */
+static inline unsigned long set_index(const myCache *c, unsigned long line) {
+    if (c->setHash == HASH_XOR) {
+        unsigned long index = 0;
+        int bits = __builtin_ctzl(c->setMask + 1);
+        for (; line && bits; line >>= bits)
+            index ^= line & c->setMask;
+        return index;
     }
+    if (c->setHash == HASH_PRIME)
+        return line % (unsigned long)c->S;
+    return line & c->setMask;
+}
+
+/* Set of `line` in way `w` of a skewed cache: a different hash for every way */
+static inline unsigned long skew_index(const myCache *c, unsigned long line, int w) {
+    return hash_line(line + (unsigned long)w * 0x9E3779B97F4A7C15UL) & c->setMask;
+}
+
+/* Return the storage of set `setIndex`, materializing its page if needed */
+static inline unsigned char *cache_set(myCache *c, unsigned long setIndex) {
+    unsigned char *page = c->pages[setIndex >> c->pageShift];
+    if (__builtin_expect(page == NULL, 0))
+        page = materialize_page(c, setIndex >> c->pageShift);
+    return page + (setIndex & c->pageMask) * c->setBytes;
 }
 
 /**
@@ -178,230 +925,2186 @@ static void allocate_cache() {
  *
  * TODO: Implement
  */
-static void free_cache() {
-    for (int i=0; i<S; i++) {
-        free(cache.sets[i].lines);
+static void free_cache(myCache *c) {
+    for (unsigned long i = 0; i < c->npages; i++) {
+        free(c->pages[i]);
     }
-    free(cache.sets);
+    free(c->pages);
 }
 
 /* Counters used to record cache statistics */
-int miss_count     = 0;
-int hit_count      = 0;
-int eviction_count = 0;
+unsigned long miss_count     = 0;
+unsigned long hit_count      = 0;
+unsigned long eviction_count = 0;
+unsigned long writeback_count = 0;  // evictions of dirty lines
 
-/* Helper function used in access_data
-*/
+/**
+ * Working-set size estimation (--wss).
+ *
+ * Distinct lines and distinct pages are counted with HyperLogLog sketches of
+ * 2^HLL_P one-byte registers (2 KB, ~2.3% standard error) each, so memory is
+ * constant whatever the trace size: one pair of sketches for the whole trace
+ * and one pair reset at every window.
+ */
+#define HLL_P 11
+#define HLL_REGISTERS (1 << HLL_P)
+#define WSS_PAGE_BITS 12    // 4 KB pages
 
-//method to check if set is full and if not, check next open line index
-int findLineIndex(cacheSet checkset){
-    for(int i=0; i<K; i++){
-        if(checkset.lines[i].valid == 0){
-            return i;
-        }
+typedef struct {
+    uint8_t reg[HLL_REGISTERS];
+} HyperLogLog;
+
+typedef struct {
+    HyperLogLog lines;
+    HyperLogLog pages;
+} WorkingSet;
+
+WorkingSet wss_total;
+WorkingSet wss_window;
+unsigned long wss_last_line = ULONG_MAX;   // consecutive repeats are skipped
+
+static inline void hll_add(HyperLogLog *h, unsigned long key) {
+    key = hash_line(key);
+    unsigned long index = key >> (64 - HLL_P);
+    uint8_t rank = __builtin_clzl((key << HLL_P) | (1UL << (HLL_P - 1))) + 1;
+    if (rank > h->reg[index])
+        h->reg[index] = rank;
+}
+
+static unsigned long hll_estimate(const HyperLogLog *h) {
+    double sum = 0.0;
+    int zeros = 0;
+    for (int i = 0; i < HLL_REGISTERS; i++) {
+        sum += 1.0 / (double)(1UL << h->reg[i]);
+        zeros += h->reg[i] == 0;
     }
-    return K; //returns K if set is full
+    double m = HLL_REGISTERS;
+    double estimate = 0.7213 / (1.0 + 1.079 / m) * m * m / sum;
+    if (estimate <= 2.5 * m && zeros)
+        estimate = m * log(m / zeros);  // linear counting for small sets
+    return (unsigned long)(estimate + 0.5);
 }
 
-//check if line and tag matches (i.e. a hit)
-int checkHit(setLine line, unsigned long tag){
-    if(line.valid){
-        if(line.tag == tag){
-            return 1;
-        }
+static inline void wss_add(unsigned long line) {
+    if (line == wss_last_line)
+        return;
+    wss_last_line = line;
+    unsigned long page = (line << blockOffsetBit) >> WSS_PAGE_BITS;
+    hll_add(&wss_total.lines, line);
+    hll_add(&wss_total.pages, page);
+    if (window_len) {
+        hll_add(&wss_window.lines, line);
+        hll_add(&wss_window.pages, page);
     }
-    return 0;
 }
 
-//find the line index to evict LRU
-int findEvictLRU(cacheSet checkset){
-    int min = checkset.lines[0].usedCountLRU;
-    int index = 0;
-    for(int i=0; i<K; i++){
-        if(min>checkset.lines[i].usedCountLRU){
-            index = i;
-            min = checkset.lines[i].usedCountLRU;
-        }
+/**
+ * Windowed statistics.
+ *
+ * A window only remembers the global counters at its start, so the per-window
+ * hits/misses/evictions are differences taken when the window is emitted and
+ * the access path pays a single compare against `window_end`.
+ */
+typedef struct {
+    unsigned long index;        // window number, from 0
+    unsigned long hits;         // hit_count at window start
+    unsigned long misses;       // miss_count at window start
+    unsigned long evictions;    // eviction_count at window start
+    unsigned long instrs;       // instr_count at window start
+} Window;
+
+/**
+ * Record layout of `--interval-format bin`, after an 8-byte magic: "CSIMWIN1"
+ * if records stop at `evictions`, "CSIMWIN2" if they also carry the --wss
+ * estimates.
+ */
+typedef struct {
+    unsigned long index;
+    unsigned long accesses;
+    unsigned long instrs;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long lines;        // distinct lines (--wss)
+    unsigned long pages;        // distinct pages (--wss)
+} WindowRecord;
+
+unsigned long instr_count = 0;  // I records seen
+unsigned long window_end = 0;   // access (or instr) count closing the window
+Window window;
+
+static void window_start() {
+    if (window_format == WINDOW_CSV) {
+        fprintf(window_fp, "window,accesses,instructions,hits,misses,evictions,miss_rate%s\n",
+                wss ? ",lines,pages" : "");
+    }
+    else {
+        fwrite(wss ? "CSIMWIN2" : "CSIMWIN1", 1, 8, window_fp);
     }
-    return index;
+    window_end = window_len;
 }
 
-//return the max usedCountLRU value in a set
-int retMaxUsedCountLRU(cacheSet checkset){
-    int max = checkset.lines[0].usedCountLRU;
-    for(int i=0; i<K; i++){
-        if(checkset.lines[i].usedCountLRU>max){
-            max = checkset.lines[i].usedCountLRU;
-        }
+static void window_emit() {
+    WindowRecord r;
+    r.index = window.index;
+    r.hits = hit_count - window.hits;
+    r.misses = miss_count - window.misses;
+    r.evictions = eviction_count - window.evictions;
+    r.instrs = instr_count - window.instrs;
+    r.accesses = r.hits + r.misses;
+    if (wss) {
+        r.lines = hll_estimate(&wss_window.lines);
+        r.pages = hll_estimate(&wss_window.pages);
+        memset(&wss_window, 0, sizeof(wss_window));
+        wss_last_line = ULONG_MAX;
+    }
+
+    if (window_format == WINDOW_CSV) {
+        fprintf(window_fp, "%lu,%lu,%lu,%lu,%lu,%lu,%.6f", r.index, r.accesses,
+                r.instrs, r.hits, r.misses, r.evictions,
+                r.accesses ? (double)r.misses / r.accesses : 0.0);
+        if (wss)
+            fprintf(window_fp, ",%lu,%lu", r.lines, r.pages);
+        fputc('\n', window_fp);
+    }
+    else {
+        fwrite(&r, wss ? sizeof(r) : offsetof(WindowRecord, lines), 1, window_fp);
     }
-    return max;
+
+    window.index += 1;
+    window.hits = hit_count;
+    window.misses = miss_count;
+    window.evictions = eviction_count;
+    window.instrs = instr_count;
+    window_end += window_len;
 }
 
-//find the line index to evict FIFO
-int findEvictFIFO(cacheSet checkset){
-    int max = checkset.lines[0].orderCountFIFO;
-    int index = 0;
-    for(int i=0; i<K; i++){
-        if(checkset.lines[i].orderCountFIFO>max){
-            index = i;
-            max = checkset.lines[i].orderCountFIFO;
-        }
+/* Emit the trailing partial window (if any) and close the output */
+static void window_finish() {
+    if (hit_count + miss_count != window.hits + window.misses || instr_count != window.instrs) {
+        window_emit();
+    }
+    if (window_fp != stdout) {
+        fclose(window_fp);
     }
-    return index;
 }
 
 /**
- * Simulate a memory access.
- *
- * If the line is already in the cache, increase `hit_count`; otherwise,
- * increase `miss_count`; increase `eviction_count` if another line must be
- * evicted. This function also updates the metadata used to implement eviction
- * policies (LRU, FIFO).
+ * Result of a simulated access, returned by the access kernels.
+ * Bit 0 is set on a miss, bit 1 if a valid line was evicted and bit 2 if
+ * that line was dirty.
+ */
+enum { ACCESS_HIT = 0, ACCESS_MISS = 1, ACCESS_EVICT = 3, ACCESS_WRITEBACK = 7 };
+
+/**
+ * Line map: open-addressing hash table from a line address to an index.
  *
- * TODO: Implement
+ * Linear probing with backward-shift deletion, so no tombstones accumulate
+ * while OPT keeps inserting and removing resident lines.
  */
-static void access_data(unsigned long addr) {
-    //compute the tag size (64 bit system) and the tag itself
-    int tagSize = 64-(blockOffsetBit + setIndexBit);
-    unsigned long tag = addr >> (blockOffsetBit + setIndexBit);
-    //compute set index
-    unsigned long temp = addr << (tagSize);
-    unsigned long setIndex = temp >> (tagSize + blockOffsetBit);
-
-    if(policy==1){ //FIFO
-        int hit = 0;
-        for(int i=0; i<K; i++){
-            if(checkHit(cache.sets[setIndex].lines[i], tag) == 1){
-                //update hit and hit_count for hit
-                hit = 1;
-                hit_count += 1;
-            }
-        }
-        if(hit == 0 && findLineIndex(cache.sets[setIndex]) == K){ // check if set is full
-            //update miss_count, evict_count, change tag and orderCountFIFO
-            miss_count += 1;
-            eviction_count += 1;
-            int evictIndex = findEvictFIFO(cache.sets[setIndex]);
-            cache.sets[setIndex].lines[evictIndex].tag = tag;
-            cache.sets[setIndex].lines[evictIndex].orderCountFIFO = 0;
-            for(int j=0; j<K; j++){
-                if(cache.sets[setIndex].lines[j].valid){
-                    cache.sets[setIndex].lines[j].orderCountFIFO += 1;
-                }
-            }
-        }
-        else if(hit == 0 && findLineIndex(cache.sets[setIndex]) < K){ // check if set is not full
-            //update miss_count, change tag, valid bit and increment orderCountFIFO
-            miss_count += 1;
-            int lineIndex = findLineIndex(cache.sets[setIndex]);
-            cache.sets[setIndex].lines[lineIndex].tag = tag;
-            cache.sets[setIndex].lines[lineIndex].valid = 1;
-            for(int j=0; j<K; j++){
-                if(cache.sets[setIndex].lines[j].valid){
-                    cache.sets[setIndex].lines[j].orderCountFIFO += 1;
-                }
-            }
+typedef struct {
+    unsigned long *keys;
+    unsigned long *values;
+    uint8_t *used;
+    unsigned long mask;     // capacity - 1 (capacity is a power of 2)
+    unsigned long count;
+} LineMap;
+
+static void *xcalloc(size_t n, size_t size) {
+    void *p = calloc(n, size);
+    if (p == NULL) {
+        fprintf(stderr, "ERROR: out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+static void linemap_init(LineMap *m, unsigned long capacity) {
+    unsigned long cap = 16;
+    while (cap < 2 * capacity)
+        cap <<= 1;
+    m->keys = xcalloc(cap, sizeof(unsigned long));
+    m->values = xcalloc(cap, sizeof(unsigned long));
+    m->used = xcalloc(cap, 1);
+    m->mask = cap - 1;
+    m->count = 0;
+}
+
+static void linemap_free(LineMap *m) {
+    free(m->keys);
+    free(m->values);
+    free(m->used);
+}
+
+static unsigned long linemap_slot(const LineMap *m, unsigned long key) {
+    unsigned long h = key * 0x9E3779B97F4A7C15UL;  // Fibonacci hashing
+    unsigned long i = (h ^ (h >> 29)) & m->mask;
+    while (m->used[i] && m->keys[i] != key)
+        i = (i + 1) & m->mask;
+    return i;
+}
+
+/* Return the slot holding `key`, or -1 if absent */
+static long linemap_find(const LineMap *m, unsigned long key) {
+    unsigned long i = linemap_slot(m, key);
+    return m->used[i] ? (long)i : -1;
+}
+
+static void linemap_put(LineMap *m, unsigned long key, unsigned long value) {
+    if (2 * (m->count + 1) > m->mask + 1) {  // keep load factor <= 1/2
+        LineMap old = *m;
+        linemap_init(m, old.mask + 1);
+        for (unsigned long i = 0; i <= old.mask; i++) {
+            if (old.used[i])
+                linemap_put(m, old.keys[i], old.values[i]);
+        }
+        linemap_free(&old);
+    }
+    unsigned long i = linemap_slot(m, key);
+    if (!m->used[i]) {
+        m->used[i] = 1;
+        m->keys[i] = key;
+        m->count++;
+    }
+    m->values[i] = value;
+}
+
+static void linemap_remove(LineMap *m, unsigned long key) {
+    unsigned long i = linemap_slot(m, key);
+    if (!m->used[i])
+        return;
+    // shift back later entries of the probe run so lookups never stop early
+    for (unsigned long j = (i + 1) & m->mask; m->used[j]; j = (j + 1) & m->mask) {
+        unsigned long h = m->keys[j] * 0x9E3779B97F4A7C15UL;
+        unsigned long home = (h ^ (h >> 29)) & m->mask;
+        if (((j - home) & m->mask) >= ((j - i) & m->mask)) {
+            m->keys[i] = m->keys[j];
+            m->values[i] = m->values[j];
+            i = j;
+        }
+    }
+    m->used[i] = 0;
+    m->count--;
+}
+
+/**
+ * Belady's optimal (MIN) replacement.
+ *
+ * OPT is offline: `opt_plan` runs a first pass over the decoded trace that
+ * turns every line access into the index of the next access to the same line
+ * (a backward scan with a LineMap of last-seen positions). The replay then
+ * evicts the resident line whose next use is furthest away. Each set keeps its
+ * ways in a max-heap on next use, and a LineMap finds resident lines, so an
+ * access costs O(log K) instead of a scan of the set.
+ */
+#define OPT_NEVER ULONG_MAX  // next use of a line that is never accessed again
+
+typedef struct {
+    unsigned long *next_use;    // per line access: index of its next access
+    unsigned long length;       // number of line accesses
+    unsigned long pos;          // index of the access being replayed
+    unsigned long *key;         // per way (S*K): next use of the resident line
+    unsigned long *line;        // per way: resident line address
+    int *heap;                  // per set: K way numbers ordered as a max-heap
+    int *heap_pos;              // per way: position of the way in its heap
+    uint8_t *dirty;             // per way: resident line was written
+    int *count;                 // per set: number of valid ways
+    LineMap resident;           // line address -> way (set * K + way)
+} OptState;
+
+OptState opt;
+
+static void opt_swap(int *heap, int *pos, int a, int b) {
+    int t = heap[a];
+    heap[a] = heap[b];
+    heap[b] = t;
+    pos[heap[a]] = a;
+    pos[heap[b]] = b;
+}
+
+/* Restore the max-heap of a set after the key of the way at position `i` changed */
+static void opt_sift(int *heap, int *pos, unsigned long *key, int n, int i) {
+    while (i > 0 && key[heap[(i - 1) / 2]] < key[heap[i]]) {
+        opt_swap(heap, pos, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    for (;;) {
+        int l = 2 * i + 1;
+        int r = l + 1;
+        int big = i;
+        if (l < n && key[heap[l]] > key[heap[big]])
+            big = l;
+        if (r < n && key[heap[r]] > key[heap[big]])
+            big = r;
+        if (big == i)
+            break;
+        opt_swap(heap, pos, i, big);
+        i = big;
+    }
+}
+
+/* Append the line access of `addr` to the decoded access stream */
+static void opt_record(unsigned long addr, unsigned long bytes, int write) {
+    (void)bytes;
+    (void)write;
+    static unsigned long capacity = 0;
+    if (opt.length == capacity) {
+        capacity = capacity ? 2 * capacity : 1 << 16;
+        opt.next_use = realloc(opt.next_use, capacity * sizeof(unsigned long));
+        if (opt.next_use == NULL) {
+            fprintf(stderr, "ERROR: out of memory\n");
+            exit(1);
+        }
+    }
+    opt.next_use[opt.length++] = addr >> blockOffsetBit;
+}
+
+/* Turn the recorded line addresses into next-use indices, in place */
+static void opt_plan() {
+    LineMap last;
+    linemap_init(&last, 1024);
+    for (unsigned long i = opt.length; i-- > 0; ) {
+        unsigned long line = opt.next_use[i];
+        long slot = linemap_find(&last, line);
+        opt.next_use[i] = slot < 0 ? OPT_NEVER : last.values[slot];
+        linemap_put(&last, line, i);
+    }
+    linemap_free(&last);
+
+    opt.key = xcalloc((size_t)S * K, sizeof(unsigned long));
+    opt.line = xcalloc((size_t)S * K, sizeof(unsigned long));
+    opt.heap = xcalloc((size_t)S * K, sizeof(int));
+    opt.heap_pos = xcalloc((size_t)S * K, sizeof(int));
+    opt.dirty = xcalloc((size_t)S * K, 1);
+    opt.count = xcalloc(S, sizeof(int));
+    linemap_init(&opt.resident, (unsigned long)S * K);
+    opt.pos = 0;
+}
+
+static void opt_free() {
+    free(opt.next_use);
+    free(opt.key);
+    free(opt.line);
+    free(opt.heap);
+    free(opt.heap_pos);
+    free(opt.dirty);
+    free(opt.count);
+    linemap_free(&opt.resident);
+}
+
+static int access_opt(myCache *c, unsigned long line, int write) {
+    unsigned long setIndex = set_index(c, line);
+    unsigned long next = opt.next_use[opt.pos++];
+    unsigned long base = setIndex * K;  // first way of the set
+    int *heap = opt.heap + base;
+    int *pos = opt.heap_pos + base;
+    unsigned long *key = opt.key + base;
+    int n = opt.count[setIndex];
+    PROFILE_COUNT(prof_lookups++; prof_ways++);  // one hash probe, no way scan
+    cache_set(c, setIndex);     // the set's page holds the line owners of shared caches
+
+    long slot = linemap_find(&opt.resident, line);
+    if (slot >= 0) {
+        int way = opt.resident.values[slot] - base;
+        opt.dirty[base + way] |= write;
+        key[way] = next;
+        opt_sift(heap, pos, key, n, pos[way]);
+        c->way = way;
+        return ACCESS_HIT;
+    }
+
+    int outcome = ACCESS_MISS;
+    int way;
+    if (n < K) {
+        way = n;
+        heap[n] = way;
+        pos[way] = n;
+        opt.count[setIndex] = ++n;
+    }
+    else {
+        way = heap[0];  // furthest next use
+        outcome = opt.dirty[base + way] ? ACCESS_WRITEBACK : ACCESS_EVICT;
+        c->victim = opt.line[base + way];
+        linemap_remove(&opt.resident, c->victim);
+    }
+    opt.line[base + way] = line;
+    opt.dirty[base + way] = write;
+    key[way] = next;
+    linemap_put(&opt.resident, line, base + way);
+    opt_sift(heap, pos, key, n, pos[way]);
+    c->way = way;
+    return outcome;
+}
+
+/**
+ * Access kernels.
+ *
+ * `access_set` looks `line` up in the K ways of a set. On a hit LRU makes the
+ * line the most recent (FIFO leaves recency alone); on a miss the way with the
+ * smallest metadata word among the ways allowed by `mask` (an invalid way if
+ * any, else the oldest line) is refilled and made the most recent. Making way
+ * `w` the most recent ages every line more recent than it by one, so both
+ * loops are branch-free over the ways.
+ *
+ * The function is always inlined: the specialized kernels below call it with
+ * a constant K and policy, which lets the compiler fully unroll the way loops
+ * (and reduce K == 1 to a single tag compare), while `access_generic` keeps
+ * the runtime-K loop and the fill mask of way partitioning for every other
+ * case. Ways past the 64th are always allowed.
+ */
+static inline __attribute__((always_inline))
+int access_set(myCache *c, unsigned char *set, int k, unsigned long line, int write, int lru,
+               unsigned long mask) {
+    unsigned long *tags = (unsigned long *)set;
+    uint16_t *meta = (uint16_t *)(tags + k);
+    int hit = -1;
+    int victim = 0;
+    // rank of a way as a victim: its metadata word, past every allowed way if masked
+    #define VICTIM_RANK(w) (meta[w] | (uint32_t)((w) < 64 && !((mask >> (w)) & 1)) << 16)
+    PROFILE_COUNT(prof_lookups++; prof_ways += k);
+#pragma GCC unroll 16
+    for (int w = 0; w < k; w++) {
+        if (tags[w] == line && (meta[w] & META_VALID))
+            hit = w;
+        if (VICTIM_RANK(w) < VICTIM_RANK(victim))
+            victim = w;
+    }
+    #undef VICTIM_RANK
+
+    int outcome = ACCESS_HIT;
+    int way = hit;
+    int dirty = write ? META_DIRTY : 0;
+    if (hit < 0) {
+        if (meta[victim] & META_VALID) {
+            outcome = (meta[victim] & META_DIRTY) ? ACCESS_WRITEBACK : ACCESS_EVICT;
+            c->victim = tags[victim];
+        }
+        else
+            outcome = ACCESS_MISS;
+        way = victim;
+        tags[way] = line;
+    }
+    else if (!lru) {
+        meta[way] |= dirty;
+        c->way = way;
+        return ACCESS_HIT;
+    }
+    else {
+        dirty |= meta[way] & META_DIRTY;
+    }
+
+    uint16_t recency = META_RECENCY(meta[way]);
+#pragma GCC unroll 16
+    for (int w = 0; w < k; w++)
+        meta[w] -= (META_RECENCY(meta[w]) > recency) << META_RECENCY_SHIFT;
+    meta[way] = (k << META_RECENCY_SHIFT) | dirty | META_VALID;
+    c->way = way;
+    return outcome;
+}
+
+static int access_generic(myCache *c, unsigned long line, int write) {
+    return access_set(c, cache_set(c, set_index(c, line)), c->K, line, write, c->policy == LRU,
+                      c->fillMask);
+}
+
+#define DEFINE_KERNEL(KK, POLICY)                                                   \
+    static int access_##POLICY##_##KK(myCache *c, unsigned long line, int write) {  \
+        return access_set(c, cache_set(c, line & c->setMask), KK, line, write,      \
+                          POLICY == LRU, ~0UL);                                     \
+    }
+
+DEFINE_KERNEL(1, FIFO)
+DEFINE_KERNEL(2, FIFO)
+DEFINE_KERNEL(4, FIFO)
+DEFINE_KERNEL(8, FIFO)
+DEFINE_KERNEL(16, FIFO)
+DEFINE_KERNEL(1, LRU)
+DEFINE_KERNEL(2, LRU)
+DEFINE_KERNEL(4, LRU)
+DEFINE_KERNEL(8, LRU)
+DEFINE_KERNEL(16, LRU)
+
+/**
+ * Sectored access: the tag lookup and replacement are those of an unsectored
+ * line, then only the sectors in `c->touched` that are not yet valid are
+ * fetched. A refilled line starts with no valid sectors; a tag hit that still
+ * fetches sectors counts as a sector miss.
+ */
+static int access_sectored(myCache *c, unsigned long line, int write) {
+    unsigned char *set = cache_set(c, set_index(c, line));
+    int outcome = access_set(c, set, c->K, line, write, c->policy == LRU, c->fillMask);
+    unsigned long *sectors = (unsigned long *)(set + c->sectorOffset);
+
+    if (outcome != ACCESS_HIT)
+        sectors[c->way] = 0;
+    c->fetched = c->touched & ~sectors[c->way];
+    sectors[c->way] |= c->touched;
+    if (c->fetched) {
+        c->sectorMisses += outcome == ACCESS_HIT;
+        c->bytesFetched += (unsigned long)__builtin_popcountl(c->fetched) << c->sectorBit;
+    }
+    return outcome;
+}
+
+/**
+ * Skewed-associative access: way w of the line is looked up in set
+ * skew_index(line, w), so lines that conflict in one way rarely conflict in
+ * the others. The K candidates live in different sets and have no common
+ * recency order, so each line carries the time of its last use (LRU) or fill
+ * (FIFO) and the oldest candidate is replaced (an invalid one first).
+ */
+static int access_skewed(myCache *c, unsigned long line, int write) {
+    int victim = 0;
+    unsigned long victimStamp = ULONG_MAX;
+    unsigned long victimSet = 0;
+    PROFILE_COUNT(prof_lookups++; prof_ways += c->K);
+    for (int w = 0; w < c->K; w++) {
+        unsigned long setIndex = skew_index(c, line, w);
+        unsigned char *set = cache_set(c, setIndex);
+        unsigned long *tags = (unsigned long *)set;
+        uint16_t *meta = (uint16_t *)(tags + c->K);
+        unsigned long *stamps = (unsigned long *)(set + c->stampOffset);
+        if ((meta[w] & META_VALID) && tags[w] == line) {
+            meta[w] |= write ? META_DIRTY : 0;
+            if (c->policy == LRU)
+                stamps[w] = ++c->clock;
+            c->way = w;
+            c->lastSet = setIndex;
+            return ACCESS_HIT;
+        }
+        unsigned long stamp = (meta[w] & META_VALID) ? stamps[w] : 0;
+        if ((w >= 64 || ((c->fillMask >> w) & 1)) && stamp < victimStamp) {
+            victim = w;
+            victimStamp = stamp;
+            victimSet = setIndex;
+        }
+    }
+
+    unsigned char *set = cache_set(c, victimSet);
+    unsigned long *tags = (unsigned long *)set;
+    uint16_t *meta = (uint16_t *)(tags + c->K);
+    unsigned long *stamps = (unsigned long *)(set + c->stampOffset);
+    int outcome = ACCESS_MISS;
+    if (meta[victim] & META_VALID) {
+        outcome = (meta[victim] & META_DIRTY) ? ACCESS_WRITEBACK : ACCESS_EVICT;
+        c->victim = tags[victim];
+    }
+    tags[victim] = line;
+    meta[victim] = META_VALID | (write ? META_DIRTY : 0);
+    stamps[victim] = ++c->clock;
+    c->way = victim;
+    c->lastSet = victimSet;
+    return outcome;
+}
+
+/* Pick the access kernel of `c` for its K and policy */
+static void select_kernel(myCache *c) {
+    static const struct {
+        int k;
+        Policy policy;
+        AccessKernel kernel;
+    } kernels[] = {
+        {1, FIFO, access_FIFO_1}, {2, FIFO, access_FIFO_2}, {4, FIFO, access_FIFO_4},
+        {8, FIFO, access_FIFO_8}, {16, FIFO, access_FIFO_16},
+        {1, LRU, access_LRU_1}, {2, LRU, access_LRU_2}, {4, LRU, access_LRU_4},
+        {8, LRU, access_LRU_8}, {16, LRU, access_LRU_16},
+    };
+
+    c->kernel = access_generic;
+    if (c->sectorOffset) {
+        c->kernel = access_sectored;
+        return;
+    }
+    if (c->policy == OPT) {
+        c->kernel = access_opt;
+        return;
+    }
+    if (c->setHash == HASH_SKEW) {
+        c->kernel = access_skewed;
+        return;
+    }
+    if ((c == &cache && way_masks) || c->setHash != HASH_BITS)
+        return;  // masked fills and hashed indexes take the generic path
+    for (size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+        if (kernels[i].k == c->K && kernels[i].policy == c->policy)
+            c->kernel = kernels[i].kernel;
+    }
+}
+
+/**
+ * Access `bytes` bytes at `addr` in cache level `c`, one access per spanned
+ * line, counting into the level's own counters. Misses fetch the line from
+ * the next level and dirty victims are written back to it.
+ */
+static void access_level(myCache *c, unsigned long addr, unsigned long bytes, int write) {
+    unsigned long line = addr >> c->blockOffsetBit;
+    unsigned long last = bytes > 1 ? (addr + bytes - 1) >> c->blockOffsetBit : line;
+    for (;;) {
+        int outcome = c->kernel(c, line, write);
+        c->hits += outcome == ACCESS_HIT;
+        c->misses += outcome & 1;
+        c->evictions += (outcome >> 1) & 1;
+        c->writebacks += outcome >> 2;
+        if (outcome != ACCESS_HIT && c->next) {
+            unsigned long victim = c->victim;
+            access_level(c->next, line << c->blockOffsetBit, 1UL << c->blockOffsetBit, 0);
+            if (outcome == ACCESS_WRITEBACK)
+                access_level(c->next, victim << c->blockOffsetBit, 1UL << c->blockOffsetBit, 1);
+        }
+        if (line == last)
+            break;
+        line++;
+    }
+}
+
+/**
+ * Cycle-approximate timing of the L1 data accesses (--timing).
+ *
+ * The caches are simulated functionally as usual; timing is layered on top.
+ * Accesses issue in trace order, `issueWidth` per cycle. A hit completes
+ * `hitLatency` cycles after issue and a miss additionally waits for the L2
+ * (`l2Latency`) and, if the L2 misses too or there is none, for memory
+ * (`memLatency`). Misses are non-blocking: each holds one of `mshrCount`
+ * MSHRs until its fill returns, an access to a line that is still in flight
+ * merges with its MSHR and completes with the fill, and a miss that finds all
+ * MSHRs busy stalls issue until the earliest one retires. Writebacks are
+ * assumed to drain through a write buffer and cost nothing.
+ *
+ * In-flight fills are kept in a min-heap on completion time (with a LineMap
+ * from line to completion time for merging), so each access is O(log n).
+ */
+typedef struct {
+    unsigned long time;         // cycle the fill completes
+    unsigned long line;
+} Fill;
+
+typedef struct {
+    unsigned long slot;         // issue slots used; issue cycle = slot / issueWidth + stall
+    unsigned long stall;        // cycles issue was blocked on full MSHRs
+    unsigned long end;          // last completion time
+    unsigned long latency;      // sum over accesses of completion - issue (incl. stalls)
+    unsigned long accesses;
+    unsigned long merges;       // accesses merged into an in-flight miss
+    unsigned long stalls;       // misses that found every MSHR busy
+    Fill *fills;                // min-heap of in-flight fills
+    unsigned long nfills;
+    LineMap inflight;           // line -> completion time of its fill
+} Timing;
+
+Timing tm;
+
+static void timing_init() {
+    tm.fills = xcalloc(mshrCount, sizeof(Fill));
+    linemap_init(&tm.inflight, mshrCount);
+}
+
+static void fill_push(Fill f) {
+    unsigned long i = tm.nfills++;
+    while (i > 0 && tm.fills[(i - 1) / 2].time > f.time) {
+        tm.fills[i] = tm.fills[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    tm.fills[i] = f;
+}
+
+static Fill fill_pop() {
+    Fill top = tm.fills[0];
+    Fill last = tm.fills[--tm.nfills];
+    unsigned long i = 0;
+    for (;;) {
+        unsigned long child = 2 * i + 1;
+        if (child >= tm.nfills)
+            break;
+        if (child + 1 < tm.nfills && tm.fills[child + 1].time < tm.fills[child].time)
+            child++;
+        if (tm.fills[child].time >= last.time)
+            break;
+        tm.fills[i] = tm.fills[child];
+        i = child;
+    }
+    tm.fills[i] = last;
+    linemap_remove(&tm.inflight, top.line);
+    return top;
+}
+
+/**
+ * Account for one L1D access to `line` that issues now. `fetch` is 0 for a
+ * hit, 1 for an L2 hit and 2 for a fill from memory.
+ */
+static void timing_access(unsigned long line, int fetch) {
+    unsigned long issue = tm.slot++ / issueWidth + tm.stall;
+    unsigned long start = issue;  // before any MSHR stall
+    while (tm.nfills && tm.fills[0].time <= issue)
+        fill_pop();
+
+    unsigned long done = issue + hitLatency;
+    long slot = linemap_find(&tm.inflight, line);
+    if (slot >= 0) {
+        tm.merges++;
+        if (tm.inflight.values[slot] > done)
+            done = tm.inflight.values[slot];
+    }
+    else if (fetch) {
+        if (tm.nfills == mshrCount) {
+            Fill f = fill_pop();
+            tm.stalls++;
+            tm.stall += f.time - issue;
+            issue = f.time;
+            while (tm.nfills && tm.fills[0].time <= issue)
+                fill_pop();
         }
+        done = issue + hitLatency;
+        if (cache.next)
+            done += l2Latency;
+        if (fetch == 2)
+            done += memLatency;
+        fill_push((Fill){done, line});
+        linemap_put(&tm.inflight, line, done);
+    }
+
+    tm.accesses++;
+    tm.latency += done - start;
+    if (done > tm.end)
+        tm.end = done;
+}
+
+/**
+ * Sampled LRU miss-ratio curve (--mrc), after SHARDS.
+ *
+ * A line is sampled if hash(line) < threshold, i.e. with probability `rate`
+ * for every access to it, so the sampled references see the reuse distances
+ * of the full trace scaled by `rate`. Reuse distances of the sampled lines are
+ * counted exactly in a treap keyed by last-access time (the distance of a
+ * reference is the number of sampled lines touched since its previous one)
+ * and entered in a histogram as distance / rate with weight 1 / rate, so
+ * capacities below about 1 / rate lines are not resolved.
+ *
+ * At most `mrcMax` lines are kept: past that, the line with the largest hash
+ * is dropped and the threshold lowered to its hash (a max-heap on hash finds
+ * it), so memory stays bounded and the rate adapts to the trace footprint.
+ * Unsampled accesses only cost one hash and compare.
+ *
+ * As in SHARDS_adj, the curve is normalized by the real number of references,
+ * and the difference between it and the weighted sampled references (hot lines
+ * that happen to be sampled skew it) is credited to the smallest distance.
+ */
+#define MRC_BUCKETS 65  // bucket i > 0 holds scaled distances in [2^(i-1), 2^i)
+
+typedef struct {
+    unsigned long key;          // last-access time of the line
+    unsigned int prio;
+    unsigned int left, right;   // child nodes, 0 if none
+    unsigned int size;          // nodes in the subtree
+} TreapNode;
+
+typedef struct {
+    unsigned long hash;
+    unsigned long line;
+} Sample;
+
+typedef struct {
+    unsigned long threshold;    // sample lines whose hash is below this
+    unsigned long clock;        // sampled references so far
+    double hist[MRC_BUCKETS];   // weighted references by scaled reuse distance
+    double cold;                // weighted references to lines not seen before
+    double total;               // weighted sampled references
+    unsigned long refs;         // all references
+    TreapNode *nodes;           // node 0 is the empty tree
+    unsigned int root;
+    unsigned int free_node;     // head of the free list, linked through `left`
+    unsigned int prio_state;
+    Sample *heap;               // max-heap on hash of the sampled lines
+    unsigned long nsamples;
+    LineMap last;               // sampled line -> last-access time
+} Shards;
+
+Shards sh;
+
+static void shards_init() {
+    sh.threshold = mrcRate >= 1.0 ? ULONG_MAX : (unsigned long)(mrcRate * 18446744073709551616.0);
+    sh.nodes = xcalloc(mrcMax + 2, sizeof(TreapNode));
+    for (unsigned long i = 1; i < mrcMax + 1; i++)
+        sh.nodes[i].left = i + 1;
+    sh.free_node = 1;
+    sh.prio_state = 2463534242u;
+    sh.heap = xcalloc(mrcMax + 1, sizeof(Sample));
+    linemap_init(&sh.last, mrcMax + 1);
+}
+
+static void shards_free() {
+    free(sh.nodes);
+    free(sh.heap);
+    linemap_free(&sh.last);
+}
+
+static inline void treap_update(unsigned int t) {
+    sh.nodes[t].size = sh.nodes[sh.nodes[t].left].size + sh.nodes[sh.nodes[t].right].size + 1;
+}
+
+/* Join two treaps whose keys are all smaller in `a` than in `b` */
+static unsigned int treap_merge(unsigned int a, unsigned int b) {
+    if (!a || !b)
+        return a ? a : b;
+    if (sh.nodes[a].prio > sh.nodes[b].prio) {
+        sh.nodes[a].right = treap_merge(sh.nodes[a].right, b);
+        treap_update(a);
+        return a;
+    }
+    sh.nodes[b].left = treap_merge(a, sh.nodes[b].left);
+    treap_update(b);
+    return b;
+}
+
+/* Insert node `n`, whose key is larger than every key in the treap */
+static unsigned int treap_append(unsigned int t, unsigned int n) {
+    if (!t)
+        return n;
+    if (sh.nodes[n].prio > sh.nodes[t].prio) {
+        sh.nodes[n].left = t;
+        treap_update(n);
+        return n;
+    }
+    sh.nodes[t].right = treap_append(sh.nodes[t].right, n);
+    treap_update(t);
+    return t;
+}
+
+static unsigned int treap_erase(unsigned int t, unsigned long key) {
+    if (sh.nodes[t].key == key) {
+        unsigned int joined = treap_merge(sh.nodes[t].left, sh.nodes[t].right);
+        sh.nodes[t].left = sh.free_node;
+        sh.free_node = t;
+        return joined;
+    }
+    if (key < sh.nodes[t].key)
+        sh.nodes[t].left = treap_erase(sh.nodes[t].left, key);
+    else
+        sh.nodes[t].right = treap_erase(sh.nodes[t].right, key);
+    treap_update(t);
+    return t;
+}
+
+/* Number of keys greater than `key` */
+static unsigned long treap_count_after(unsigned int t, unsigned long key) {
+    unsigned long n = 0;
+    while (t) {
+        if (sh.nodes[t].key > key) {
+            n += sh.nodes[sh.nodes[t].right].size + 1;
+            t = sh.nodes[t].left;
+        }
+        else {
+            t = sh.nodes[t].right;
+        }
+    }
+    return n;
+}
+
+static void sample_push(Sample s) {
+    unsigned long i = sh.nsamples++;
+    while (i > 0 && sh.heap[(i - 1) / 2].hash < s.hash) {
+        sh.heap[i] = sh.heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    sh.heap[i] = s;
+}
+
+static Sample sample_pop() {
+    Sample top = sh.heap[0];
+    Sample last = sh.heap[--sh.nsamples];
+    unsigned long i = 0;
+    for (;;) {
+        unsigned long child = 2 * i + 1;
+        if (child >= sh.nsamples)
+            break;
+        if (child + 1 < sh.nsamples && sh.heap[child + 1].hash > sh.heap[child].hash)
+            child++;
+        if (sh.heap[child].hash <= last.hash)
+            break;
+        sh.heap[i] = sh.heap[child];
+        i = child;
+    }
+    sh.heap[i] = last;
+    return top;
+}
+
+/* Sampled reference to `line` */
+static void shards_sample(unsigned long line, unsigned long hash) {
+    double rate = sh.threshold / 18446744073709551616.0;
+    long slot = linemap_find(&sh.last, line);
+    if (slot >= 0) {
+        unsigned long prev = sh.last.values[slot];
+        unsigned long distance = treap_count_after(sh.root, prev) / rate;
+        sh.hist[distance ? 64 - __builtin_clzl(distance) : 0] += 1.0 / rate;
+        sh.root = treap_erase(sh.root, prev);
+    }
+    else {
+        sh.cold += 1.0 / rate;
+        sample_push((Sample){hash, line});
     }
-    else if(policy==2){ //LRU
-        int hit = 0;
-        //check for hit first
-        for(int i=0; i<K; i++){
-            if(checkHit(cache.sets[setIndex].lines[i], tag) == 1){
-                //update hit, hit_count and usedCountLRU for hit
-                hit = 1;
-                hit_count += 1;
-                cache.sets[setIndex].lines[i].usedCountLRU = retMaxUsedCountLRU(cache.sets[setIndex])+1;
+    sh.total += 1.0 / rate;
+
+    unsigned int n = sh.free_node;
+    sh.free_node = sh.nodes[n].left;
+    sh.prio_state ^= sh.prio_state << 13;  // xorshift32 treap priorities
+    sh.prio_state ^= sh.prio_state >> 17;
+    sh.prio_state ^= sh.prio_state << 5;
+    sh.nodes[n] = (TreapNode){sh.clock, sh.prio_state, 0, 0, 1};
+    sh.root = treap_append(sh.root, n);
+    linemap_put(&sh.last, line, sh.clock++);
+
+    if (sh.nsamples > mrcMax) {
+        // drop the line with the largest hash and sample below it from now on
+        Sample s = sample_pop();
+        sh.threshold = s.hash;
+        slot = linemap_find(&sh.last, s.line);
+        sh.root = treap_erase(sh.root, sh.last.values[slot]);
+        linemap_remove(&sh.last, s.line);
+    }
+}
+
+static inline void shards_access(unsigned long line) {
+    unsigned long hash = hash_line(line);
+    sh.refs++;
+    if (hash < sh.threshold)
+        shards_sample(line, hash);
+}
+
+/**
+ * Print the curve at power-of-two capacities, from one line to the largest
+ * reuse distance seen, with the binomial standard error of each miss ratio
+ * over the sampled references.
+ */
+static void shards_print() {
+    int top = MRC_BUCKETS - 1;
+    while (top > 0 && sh.hist[top] == 0.0)
+        top--;
+    printf("mrc_rate:%.6f mrc_refs:%lu mrc_lines:%lu\n",
+           sh.threshold / 18446744073709551616.0, sh.clock, sh.nsamples);
+    double hits = sh.refs - sh.total;
+    for (int i = 0; i <= top; i++) {
+        hits += sh.hist[i];
+        double ratio = sh.refs ? 1.0 - hits / sh.refs : 0.0;
+        if (ratio < 0.0)
+            ratio = 0.0;
+        if (ratio > 1.0)
+            ratio = 1.0;
+        double err = sh.clock ? sqrt(ratio * (1.0 - ratio) / sh.clock) : 0.0;
+        printf("mrc lines:%lu bytes:%lu miss_ratio:%.6f stderr:%.6f\n",
+               1UL << i, (1UL << i) * B, ratio, err);
+    }
+}
+
+/**
+ * Hot-line and conflict-set report (--top).
+ *
+ * Space-Saving keeps TOP_SLACK * N counters, and at least TOP_MIN_COUNTERS,
+ * for the N most frequent keys: a key without a counter takes over the
+ * smallest one and inherits its count as an overestimate, so a counter is
+ * never more than total / counters too high. Misses spread over many lines
+ * make that bound close to the counts themselves, so the table is sized for
+ * the distinct lines of a typical trace, whose counts are then exact, rather
+ * than for N alone. The counters form a min-heap on count, with a LineMap
+ * from key to heap position, so every update is O(log counters).
+ */
+#define TOP_SLACK 8
+#define TOP_MIN_COUNTERS (1UL << 14)
+
+typedef struct {
+    unsigned long key;
+    unsigned long count;
+    unsigned long error;        // overestimate inherited from the evicted key
+} TopCounter;
+
+typedef struct {
+    TopCounter *heap;           // min-heap on count
+    unsigned long n;
+    unsigned long capacity;
+    LineMap index;              // key -> heap position
+} TopSketch;
+
+TopSketch top_lines;            // L1D lines by misses
+TopSketch top_sets;             // L1D sets by evictions
+
+static void top_init(TopSketch *t) {
+    t->capacity = TOP_SLACK * topN > TOP_MIN_COUNTERS ? TOP_SLACK * topN : TOP_MIN_COUNTERS;
+    t->heap = xcalloc(t->capacity, sizeof(TopCounter));
+    linemap_init(&t->index, t->capacity);
+}
+
+static void top_free(TopSketch *t) {
+    free(t->heap);
+    linemap_free(&t->index);
+}
+
+/* Move the counter at `i` down to restore the heap after its count grew */
+static void top_sift(TopSketch *t, unsigned long i) {
+    TopCounter c = t->heap[i];
+    for (;;) {
+        unsigned long child = 2 * i + 1;
+        if (child >= t->n)
+            break;
+        if (child + 1 < t->n && t->heap[child + 1].count < t->heap[child].count)
+            child++;
+        if (t->heap[child].count >= c.count)
+            break;
+        t->heap[i] = t->heap[child];
+        linemap_put(&t->index, t->heap[i].key, i);
+        i = child;
+    }
+    t->heap[i] = c;
+    linemap_put(&t->index, c.key, i);
+}
+
+static void top_add(TopSketch *t, unsigned long key) {
+    long slot = linemap_find(&t->index, key);
+    if (slot >= 0) {
+        unsigned long i = t->index.values[slot];
+        t->heap[i].count++;
+        top_sift(t, i);
+        return;
+    }
+    if (t->n < t->capacity) {
+        // a new counter of 1 is a minimum, so the root is the right place
+        unsigned long i = t->n++;
+        while (i > 0) {
+            unsigned long parent = (i - 1) / 2;
+            t->heap[i] = t->heap[parent];
+            linemap_put(&t->index, t->heap[i].key, i);
+            i = parent;
+        }
+        t->heap[0] = (TopCounter){key, 1, 0};
+        linemap_put(&t->index, key, 0);
+        return;
+    }
+    linemap_remove(&t->index, t->heap[0].key);
+    t->heap[0] = (TopCounter){key, t->heap[0].count + 1, t->heap[0].count};
+    top_sift(t, 0);
+}
+
+/* Largest count first, then lowest key, so ties print in a stable order */
+static int top_compare(const void *a, const void *b) {
+    const TopCounter *x = a, *y = b;
+    if (x->count != y->count)
+        return x->count < y->count ? 1 : -1;
+    return x->key < y->key ? -1 : x->key > y->key;
+}
+
+/* Sort the counters, largest first, and return how many to report */
+static unsigned long top_sort(TopSketch *t) {
+    qsort(t->heap, t->n, sizeof(TopCounter), top_compare);
+    return t->n < topN ? t->n : topN;
+}
+
+/**
+ * Print the top lines with the byte range they cover, and the top sets with
+ * the addresses that map to them (offset within a stride of S * B bytes;
+ * hashed set indices have no such range). Shares are of all L1D misses and
+ * evictions; `error` bounds how much a count may be overestimated.
+ */
+static void top_print() {
+    unsigned long n = top_sort(&top_lines);
+    for (unsigned long i = 0; i < n; i++) {
+        TopCounter *c = &top_lines.heap[i];
+        printf("top_line addr:0x%lx-0x%lx misses:%lu share:%.2f%% error:%lu\n",
+               c->key << blockOffsetBit, ((c->key + 1) << blockOffsetBit) - 1, c->count,
+               100.0 * c->count / miss_count, c->error);
+    }
+    n = top_sort(&top_sets);
+    for (unsigned long i = 0; i < n; i++) {
+        TopCounter *c = &top_sets.heap[i];
+        if (setHash != HASH_BITS) {
+            printf("top_set set:%lu evictions:%lu share:%.2f%% error:%lu\n", c->key, c->count,
+                   100.0 * c->count / eviction_count, c->error);
+            continue;
+        }
+        printf("top_set set:%lu addr:0x%lx-0x%lx mod 0x%lx evictions:%lu share:%.2f%% error:%lu\n",
+               c->key, c->key << blockOffsetBit, ((c->key + 1) << blockOffsetBit) - 1,
+               (unsigned long)S << blockOffsetBit, c->count,
+               100.0 * c->count / eviction_count, c->error);
+    }
+}
+
+/**
+ * Per-region L1D counters (--regions).
+ *
+ * Regions are disjoint address ranges sorted by first address, so the region
+ * of an access is a binary search, O(log R). A region map file lists them as
+ * `<name> <first> <last>` lines of inclusive hex bounds ('#' starts a
+ * comment), and accesses outside all of them count as `other`. With
+ * `--regions auto` they are clustered from the trace instead: a line within
+ * REGION_GAP bytes of a region extends it (joining two regions that meet),
+ * and any other line starts a new one. Stack, globals, heap and mmap areas
+ * sit far apart, so they end up in separate regions.
+ */
+#define REGION_GAP (64UL << 10)
+#define REGION_NAME 32
+
+typedef struct {
+    unsigned long first;
+    unsigned long last;         // inclusive
+    char name[REGION_NAME];
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+} Region;
+
+typedef struct {
+    Region *r;                  // sorted by first
+    unsigned long n;
+    unsigned long capacity;
+    int clustered;              // 1 for --regions auto
+    Region other;               // accesses outside every mapped region
+} RegionMap;
+
+RegionMap regions;
+
+/* Insert `r` at position `i`, keeping the array sorted */
+static void region_insert(unsigned long i, Region r) {
+    if (regions.n == regions.capacity) {
+        regions.capacity = regions.capacity ? 2 * regions.capacity : 16;
+        regions.r = realloc(regions.r, regions.capacity * sizeof(Region));
+        if (regions.r == NULL) {
+            fprintf(stderr, "ERROR: out of memory\n");
+            exit(1);
+        }
+    }
+    memmove(&regions.r[i + 1], &regions.r[i], (regions.n - i) * sizeof(Region));
+    regions.r[i] = r;
+    regions.n++;
+}
+
+static int region_compare(const void *a, const void *b) {
+    const Region *x = a, *y = b;
+    return x->first < y->first ? -1 : x->first > y->first;
+}
+
+/* Read the region map at `region_path`, or start an empty clustered map */
+static void regions_init() {
+    strcpy(regions.other.name, "other");
+    if (!strcmp(region_path, "auto")) {
+        regions.clustered = 1;
+        return;
+    }
+    FILE *fp = fopen(region_path, "r");
+    if (!fp) {
+        fprintf(stderr, "ERROR: %s: %s\n", region_path, strerror(errno));
+        exit(1);
+    }
+    char buf[256];
+    for (int lineno = 1; fgets(buf, sizeof(buf), fp); lineno++) {
+        char *comment = strchr(buf, '#');
+        if (comment)
+            *comment = '\0';
+        Region r = {0};
+        char rest;
+        int n = sscanf(buf, "%31s %lx %lx %c", r.name, &r.first, &r.last, &rest);
+        if (n == EOF)
+            continue;           // blank or comment line
+        if (n != 3 || r.first > r.last) {
+            fprintf(stderr, "ERROR: %s:%d: expected '<name> <first> <last>'\n", region_path, lineno);
+            exit(1);
+        }
+        region_insert(regions.n, r);
+    }
+    fclose(fp);
+    qsort(regions.r, regions.n, sizeof(Region), region_compare);
+    for (unsigned long i = 1; i < regions.n; i++) {
+        if (regions.r[i].first <= regions.r[i - 1].last) {
+            fprintf(stderr, "ERROR: regions %s and %s overlap\n", regions.r[i - 1].name,
+                    regions.r[i].name);
+            exit(1);
+        }
+    }
+}
+
+/* Region of the line at `addr`, growing the clustered map if needed */
+static Region *region_of(unsigned long addr) {
+    unsigned long lo = 0, hi = regions.n;
+    while (lo < hi) {           // first region starting after addr
+        unsigned long mid = (lo + hi) / 2;
+        if (regions.r[mid].first <= addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo > 0 && addr <= regions.r[lo - 1].last)
+        return &regions.r[lo - 1];
+    if (!regions.clustered)
+        return &regions.other;
+
+    // clustered bounds are whole lines, so a line is never split between regions
+    unsigned long first = addr & ~(unsigned long)(B - 1);
+    unsigned long last = first + B - 1;
+    Region *prev = lo > 0 ? &regions.r[lo - 1] : NULL;
+    Region *next = lo < regions.n ? &regions.r[lo] : NULL;
+    int near_prev = prev && first - prev->last <= REGION_GAP;
+    int near_next = next && next->first - last <= REGION_GAP;
+    if (near_prev && near_next) {
+        prev->last = next->last;
+        prev->hits += next->hits;
+        prev->misses += next->misses;
+        prev->evictions += next->evictions;
+        memmove(next, next + 1, (regions.n - lo - 1) * sizeof(Region));
+        regions.n--;
+        return prev;
+    }
+    if (near_prev) {
+        prev->last = last;
+        return prev;
+    }
+    if (near_next) {
+        next->first = first;
+        return next;
+    }
+    region_insert(lo, (Region){.first = first, .last = last});
+    return &regions.r[lo];
+}
+
+/* Print one line per region in address order; clustered regions are numbered */
+static void regions_print() {
+    for (unsigned long i = 0; i < regions.n; i++) {
+        Region *r = &regions.r[i];
+        if (regions.clustered)
+            snprintf(r->name, REGION_NAME, "%lu", i);
+        printf("region:%s addr:0x%lx-0x%lx hits:%lu misses:%lu evictions:%lu\n", r->name,
+               r->first, r->last, r->hits, r->misses, r->evictions);
+    }
+    Region *o = &regions.other;
+    if (o->hits + o->misses) {
+        printf("region:other hits:%lu misses:%lu evictions:%lu\n", o->hits, o->misses,
+               o->evictions);
+    }
+    free(regions.r);
+}
+
+/**
+ * Simulate a memory access.
+ *
+ * If the line is already in the cache, increase `hit_count`; otherwise,
+ * increase `miss_count`; increase `eviction_count` if another line must be
+ * evicted (and `writeback_count` if it was dirty). The selected kernel
+ * updates the metadata used to implement eviction policies (LRU, FIFO, OPT).
+ * Misses and writebacks go on to the L2, if any.
+ *
+ * `addr` and `bytes` describe the part of the access that falls in one line;
+ * sectored caches fetch only the sectors it covers.
+ */
+static void access_data(unsigned long addr, unsigned long bytes, int write) {
+    if (sectorSize) {
+        int first = (addr & (B - 1)) >> cache.sectorBit;
+        int last = ((addr & (B - 1)) + bytes - 1) >> cache.sectorBit;
+        cache.touched = (~0UL >> (63 - last)) & (~0UL << first);
+    }
+    unsigned long line = addr >> blockOffsetBit;
+    if (wss)
+        wss_add(line);
+    if (mrcRate)
+        shards_access(line);
+    if (way_masks)
+        cache.fillMask = streams[current_stream].mask;
+    int outcome = cache.kernel(&cache, line, write);
+    hit_count += outcome == ACCESS_HIT;
+    miss_count += outcome & 1;
+    eviction_count += (outcome >> 1) & 1;
+    writeback_count += outcome >> 2;
+    if (nstreams > 1) {
+        Stream *st = &streams[current_stream];
+        st->hits += outcome == ACCESS_HIT;
+        st->misses += outcome & 1;
+        st->evictions += (outcome >> 1) & 1;
+        if (outcome != ACCESS_HIT) {
+            unsigned long set = setHash == HASH_SKEW ? cache.lastSet : set_index(&cache, line);
+            uint8_t *owner = cache_set(&cache, set) + cache.ownerOffset;
+            if (outcome != ACCESS_MISS && owner[cache.way] != current_stream)
+                streams[owner[cache.way]].evicted++;
+            owner[cache.way] = current_stream;
+        }
+    }
+    if (region_path) {
+        Region *r = region_of(addr);
+        r->hits += outcome == ACCESS_HIT;
+        r->misses += outcome & 1;
+        r->evictions += (outcome >> 1) & 1;
+    }
+    if (topN && outcome != ACCESS_HIT) {
+        top_add(&top_lines, line);
+        if (outcome != ACCESS_MISS)
+            top_add(&top_sets, setHash == HASH_SKEW ? cache.lastSet : set_index(&cache, line));
+    }
+    // 0 for a hit, 1 for a fill from the L2, 2 for a fill from memory (see timing_access)
+    int fetch = sectorSize ? cache.fetched != 0 : outcome != ACCESS_HIT;
+    if (fetch && !cache.next)
+        fetch = 2;
+    if (cache.next) {
+        unsigned long victim = cache.victim;
+        unsigned long line_addr = addr & ~(unsigned long)(B - 1);
+        unsigned long l2_misses = l2cache.misses;
+        if (!sectorSize) {
+            if (outcome != ACCESS_HIT)
+                access_level(cache.next, line_addr, B, 0);
+        }
+        else if (cache.fetched) {
+            // fetch from the lowest to the highest missing sector
+            int first = __builtin_ctzl(cache.fetched);
+            int last = 63 - __builtin_clzl(cache.fetched);
+            access_level(cache.next, line_addr + ((unsigned long)first << cache.sectorBit),
+                         (unsigned long)(last - first + 1) << cache.sectorBit, 0);
+        }
+        if (l2cache.misses != l2_misses)
+            fetch = 2;          // the fill missed in the L2 too
+        if (outcome == ACCESS_WRITEBACK)
+            access_level(cache.next, victim << blockOffsetBit, B, 1);
+    }
+    if (timing)
+        timing_access(line, fetch);
+}
+
+/* Simulate one access and close the current window if it just filled up */
+static void simulate(unsigned long addr, unsigned long bytes, int write) {
+    access_data(addr, bytes, write);
+    if (window_len && !window_by_instr && hit_count + miss_count == window_end) {
+        window_emit();
+    }
+}
+
+/**
+ * Visit every cache line spanned by `size` bytes starting at `address`, with
+ * the first address and byte count of the access that fall in that line.
+ *
+ * The spanned lines are computed directly from the first and last byte, so a
+ * large record costs one step per line rather than one per byte. `S` visits
+ * each line as a write, `M` visits it twice in a row (read, then write) and
+ * `L`/`R` read it once.
+ */
+static void access_range(unsigned long address, unsigned long size, char op,
+                         void (*visit)(unsigned long addr, unsigned long bytes, int write)) {
+    unsigned long end = size > 1 ? address + size - 1 : address;  // last byte
+    unsigned long line = address >> blockOffsetBit;
+    unsigned long last = end >> blockOffsetBit;
+    unsigned long lo = address;
+    for (;;) {
+        unsigned long hi = line == last ? end : ((line + 1) << blockOffsetBit) - 1;
+        if (op == 'M')
+            visit(lo, hi - lo + 1, 0);
+        visit(lo, hi - lo + 1, op == 'S' || op == 'M');
+        if (line == last)
+            break;
+        line++;
+        lo = line << blockOffsetBit;
+    }
+}
+
+/* One decoded trace record */
+typedef struct {
+    unsigned long address;
+    unsigned int size;
+    char op;                    // 'I', 'L', 'S', 'M' or 'R'
+    uint8_t stream;             // index in `streams`
+} TraceRecord;
+
+/**
+ * Trace decoders.
+ *
+ * Every trace is read through a Decoder, which turns its input into batches
+ * of TraceRecords for `next_record`, whatever tool wrote it:
+ *
+ * - lackey: Valgrind lackey text, ` <op> <hex address>,<size>` per line.
+ *   Lines that do not parse or whose op is not I, L, S, M or R are skipped.
+ * - drmemtrace: DynamoRIO drcachesim trace files (12-byte packed
+ *   trace_entry_t records, after raw2trace). Reads and writes become L and
+ *   S, instruction fetches (bundles included) become I; prefetches, markers
+ *   and thread/process bookkeeping are skipped.
+ * - pin: the 64-byte per-instruction records of the Pin-based ChampSim
+ *   tracer. Each becomes an I of the instruction pointer, one L per source
+ *   memory operand and one S per destination operand. The tracer records
+ *   neither instruction lengths nor operand sizes, so all are 1 byte.
+ *
+ * With `--format auto` (the default) a trace starting with a drmemtrace
+ * header entry is drmemtrace, one starting with text is lackey and anything
+ * else is pin.
+ */
+#define DECODE_BUFFER (1 << 16)  // bytes of input read at a time
+#define DECODE_BATCH 256         // records decoded at a time
+
+typedef struct Decoder {
+    FILE *fp;
+    TraceFormat format;
+    size_t (*decode)(struct Decoder *d, TraceRecord *out, size_t max);
+    unsigned char buf[DECODE_BUFFER];
+    size_t len;                 // bytes in `buf`
+    size_t pos;                 // next byte to decode
+    int eof;                    // 1 once `fp` is exhausted
+    TraceRecord batch[DECODE_BATCH];
+    size_t n;                   // records in `batch`
+    size_t next;                // next record to return
+    unsigned long pc;           // drmemtrace: last instruction fetched
+    unsigned int pc_size;
+} Decoder;
+
+/* Keep the undecoded bytes and read more; returns the bytes available */
+static size_t decoder_fill(Decoder *d) {
+    memmove(d->buf, d->buf + d->pos, d->len - d->pos);
+    d->len -= d->pos;
+    d->pos = 0;
+    if (!d->eof) {
+        size_t n = fread(d->buf + d->len, 1, DECODE_BUFFER - d->len, d->fp);
+        d->len += n;
+        d->eof = n == 0;
+    }
+    return d->len;
+}
+
+/* Parse one lackey line in [p, end); returns 1 and fills `r` if it is a record */
+static int parse_lackey_line(const unsigned char *p, const unsigned char *end, TraceRecord *r) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+        p++;
+    if (p == end)
+        return 0;
+    char op = *p++;
+    if (op != 'I' && op != 'L' && op != 'S' && op != 'M' && op != 'R')
+        return 0;
+    while (p < end && (*p == ' ' || *p == '\t'))
+        p++;
+    if (end - p > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X'))
+        p += 2;
+    unsigned long address = 0;
+    const unsigned char *digits = p;
+    for (; p < end; p++) {
+        unsigned int v;
+        if (*p >= '0' && *p <= '9')
+            v = *p - '0';
+        else if ((*p | 0x20) >= 'a' && (*p | 0x20) <= 'f')
+            v = (*p | 0x20) - 'a' + 10;
+        else
+            break;
+        address = address << 4 | v;
+    }
+    if (p == digits || p == end || *p++ != ',')
+        return 0;
+    unsigned long size = 0;
+    digits = p;
+    for (; p < end && *p >= '0' && *p <= '9'; p++)
+        size = size * 10 + (*p - '0');
+    if (p == digits)
+        return 0;
+    r->op = op;
+    r->address = address;
+    r->size = size;
+    return 1;
+}
+
+static size_t decode_lackey(Decoder *d, TraceRecord *out, size_t max) {
+    size_t n = 0;
+    while (n < max) {
+        unsigned char *start = d->buf + d->pos;
+        unsigned char *nl = memchr(start, '\n', d->len - d->pos);
+        if (nl == NULL) {
+            if (!d->eof && (d->pos > 0 || d->len < DECODE_BUFFER)) {
+                decoder_fill(d);  // the line continues past the buffered bytes
+                continue;
             }
+            if (d->pos == d->len)
+                break;
+            nl = d->buf + d->len;  // last line without a newline (or an overlong one)
+        }
+        n += parse_lackey_line(start, nl, &out[n]);
+        d->pos = nl - d->buf + (nl < d->buf + d->len);
+    }
+    return n;
+}
+
+/* trace_type_t values of DynamoRIO's clients/drcachesim/common/trace_entry.h */
+enum {
+    DR_READ = 0,
+    DR_WRITE = 1,
+    DR_INSTR = 10,              // 10-16: instructions, by branch kind
+    DR_INSTR_RETURN = 16,
+    DR_INSTR_BUNDLE = 17,       // `size` more instructions, lengths in the address bytes
+    DR_HEADER = 25,
+    DR_INSTR_NO_FETCH = 29,
+    DR_INSTR_MAYBE_FETCH = 30,
+    DR_INSTR_SYSENTER = 31,
+};
+
+#define DR_ENTRY_BYTES 12       // packed {uint16 type; uint16 size; uint64 addr}
+
+static size_t decode_drmemtrace(Decoder *d, TraceRecord *out, size_t max) {
+    size_t n = 0;
+    while (n + 8 <= max) {      // a bundle adds up to 8 records
+        if (d->len - d->pos < DR_ENTRY_BYTES && decoder_fill(d) < DR_ENTRY_BYTES)
+            break;
+        const unsigned char *e = d->buf + d->pos;
+        d->pos += DR_ENTRY_BYTES;
+        uint16_t type, size;
+        uint64_t addr;
+        memcpy(&type, e, 2);
+        memcpy(&size, e + 2, 2);
+        memcpy(&addr, e + 4, 8);
+        if (type == DR_READ || type == DR_WRITE) {
+            out[n++] = (TraceRecord){addr, size, type == DR_READ ? 'L' : 'S', 0};
+        }
+        else if ((type >= DR_INSTR && type <= DR_INSTR_RETURN) ||
+                 type == DR_INSTR_MAYBE_FETCH || type == DR_INSTR_SYSENTER) {
+            d->pc = addr;
+            d->pc_size = size;
+            out[n++] = (TraceRecord){addr, size, 'I', 0};
+        }
+        else if (type == DR_INSTR_BUNDLE) {
+            for (int i = 0; i < size && i < 8; i++) {
+                d->pc += d->pc_size;
+                d->pc_size = e[4 + i];
+                out[n++] = (TraceRecord){d->pc, d->pc_size, 'I', 0};
+            }
+        }
+    }
+    return n;
+}
+
+/* ChampSim's input_instr, as written by its Pin tracer */
+typedef struct {
+    uint64_t ip;
+    uint8_t is_branch;
+    uint8_t branch_taken;
+    uint8_t destination_registers[2];
+    uint8_t source_registers[4];
+    uint64_t destination_memory[2];
+    uint64_t source_memory[4];
+} PinRecord;
+
+static size_t decode_pin(Decoder *d, TraceRecord *out, size_t max) {
+    size_t n = 0;
+    while (n + 7 <= max) {      // an instruction adds up to 7 records
+        if (d->len - d->pos < sizeof(PinRecord) && decoder_fill(d) < sizeof(PinRecord))
+            break;
+        PinRecord in;
+        memcpy(&in, d->buf + d->pos, sizeof(in));
+        d->pos += sizeof(in);
+        out[n++] = (TraceRecord){in.ip, 1, 'I', 0};
+        for (int i = 0; i < 4; i++) {
+            if (in.source_memory[i])
+                out[n++] = (TraceRecord){in.source_memory[i], 1, 'L', 0};
         }
-        if (hit == 0 && findLineIndex(cache.sets[setIndex]) == K){ // check if set is full
-            //update miss_count, evict_count, change tag and usedCountLRU
-            miss_count += 1;
-            eviction_count += 1;
-            int evictIndex = findEvictLRU(cache.sets[setIndex]);
-            cache.sets[setIndex].lines[evictIndex].tag = tag;
-            cache.sets[setIndex].lines[evictIndex].usedCountLRU = retMaxUsedCountLRU(cache.sets[setIndex])+1;
+        for (int i = 0; i < 2; i++) {
+            if (in.destination_memory[i])
+                out[n++] = (TraceRecord){in.destination_memory[i], 1, 'S', 0};
         }
-        else if (hit == 0 && findLineIndex(cache.sets[setIndex]) < K){ // check if set is not full
-            //update miss_count, change tag, valid bit and usedCountLRU
-            miss_count += 1;
-            int lineIndex = findLineIndex(cache.sets[setIndex]);
-            cache.sets[setIndex].lines[lineIndex].tag = tag;
-            cache.sets[setIndex].lines[lineIndex].valid = 1;
-            cache.sets[setIndex].lines[lineIndex].usedCountLRU = retMaxUsedCountLRU(cache.sets[setIndex])+1;
+    }
+    return n;
+}
+
+/* Guess the format of a trace from its first bytes */
+static TraceFormat detect_format(Decoder *d) {
+    size_t len = decoder_fill(d);
+    uint16_t type = 0, size = 1;
+    if (len >= DR_ENTRY_BYTES) {
+        memcpy(&type, d->buf, 2);
+        memcpy(&size, d->buf + 2, 2);
+    }
+    if (type == DR_HEADER && size == 0)
+        return FORMAT_DRMEMTRACE;
+    size_t text = 0;
+    while (text < len && text < 64 && (d->buf[text] == '\n' || d->buf[text] == '\t' ||
+                                       d->buf[text] == '\r' ||
+                                       (d->buf[text] >= 0x20 && d->buf[text] < 0x7f)))
+        text++;
+    return text == len || text == 64 ? FORMAT_LACKEY : FORMAT_PIN;
+}
+
+static Decoder *decoder_open(FILE *fp) {
+    Decoder *d = xcalloc(1, sizeof(Decoder));
+    d->fp = fp;
+    d->format = trace_format ? trace_format : detect_format(d);
+    d->decode = d->format == FORMAT_DRMEMTRACE ? decode_drmemtrace :
+                d->format == FORMAT_PIN ? decode_pin : decode_lackey;
+    return d;
+}
+
+static void decoder_close(Decoder *d) {
+    fclose(d->fp);
+    free(d);
+}
+
+/**
+ * Read the next record of the trace decoded by `d`. Returns 0 at the end of
+ * the trace.
+ */
+static int read_record(Decoder *d, TraceRecord *r) {
+    if (d->next == d->n) {
+        d->n = d->decode(d, d->batch, DECODE_BATCH);
+        d->next = 0;
+        if (d->n == 0)
+            return 0;
+    }
+    *r = d->batch[d->next++];
+    return 1;
+}
+
+/* Read the next record pushed to the --shm ring, batching the ring reads */
+static int read_shm_record(TraceRecord *r) {
+    static CsimShmRecord batch[256];
+    static size_t n = 0, next = 0;
+    for (;;) {
+        if (next == n) {
+            n = csim_shm_pop(shm_ring, batch, sizeof(batch) / sizeof(batch[0]));
+            next = 0;
+            if (n == 0)
+                return 0;
+        }
+        CsimShmRecord *b = &batch[next++];
+        if (b->op && strchr("ILSMR", b->op)) {
+            r->op = b->op;
+            r->address = b->address;
+            r->size = b->size;
+            r->stream = 0;
+            return 1;
         }
     }
 }
 
+/**
+ * Read the next record of the interleaved traces into `r`, tagged with its
+ * stream. Returns 0 once every trace has ended.
+ */
+static int next_record(TraceRecord *r) {
+    static int turn = 0;        // next stream of round-robin order
+    if (shm_ring)
+        return read_shm_record(r);
+    if (nstreams == 1) {
+        r->stream = 0;
+        return read_record(streams[0].dec, r);
+    }
+    for (;;) {
+        int pick = -1;
+        for (int n = 0; n < nstreams; n++) {
+            int i = (turn + n) % nstreams;
+            if (streams[i].done)
+                continue;
+            if (interleave == INTERLEAVE_RR) {
+                pick = i;
+                break;
+            }
+            if (pick < 0 || streams[i].clock < streams[pick].clock)
+                pick = i;
+        }
+        if (pick < 0)
+            return 0;
+        Stream *st = &streams[pick];
+        if (!read_record(st->dec, r)) {
+            st->done = 1;
+            continue;
+        }
+        if (r->op == 'I')
+            st->seen_instr = 1;
+        st->clock += r->op == 'I' || !st->seen_instr;
+        turn = interleave == INTERLEAVE_RR ? (pick + 1) % nstreams : 0;
+        r->stream = pick;
+        return 1;
+    }
+}
+
+/* Simulate the cache accesses of one record */
+static void replay_record(const TraceRecord *r) {
+    current_stream = r->stream;
+    switch(r->op){
+        //I fetches from the instruction cache, if any, and advances the
+        //instruction clock of --interval-instr windows
+        case 'I':
+            if (icache.kernel)
+                access_level(&icache, r->address, r->size, 0);
+            instr_count += 1;
+            if (window_by_instr && instr_count == window_end) {
+                window_emit();
+            }
+            break;
+        default:
+            access_range(r->address, r->size, r->op, simulate);
+            break;
+    }
+}
+
 /**
  * Replay the input trace.
  *
  * This function:
- * - reads lines (e.g., using fgets) from the file handle `trace_fp` (a global variable)
- * - skips lines not starting with ` S`, ` L` or ` M`
- * - parses the memory address (unsigned long, in hex) and len (unsigned int, in decimal)
- *   from each input line
- * - calls `access_data(address)` for each access to a cache line
+ * - reads records from the decoders of the traces (see Trace decoders),
+ *   which skip input that is not a record
+ * - fetches each `I` record from the instruction cache, if any, and counts it
+ *   for --interval-instr
+ * - calls `access_data(address)` for each cache line that an `L`, `S`, `M`
+ *   or `R` record touches
  *
- * TODO: Implement
+ * ` R addr,len` is a bulk range record (memcpy/memset-style traffic): it reads
+ * every line of the range once, like an `L` of `len` bytes.
+ *
+ * OPT needs the future of the trace, so it first decodes the whole trace into
+ * memory, plans next uses and then replays the decoded records.
+ *
+ * Several traces are merged into one record stream by `next_record`.
  */
 static void replay_trace() {
+    TraceRecord r;
 
-    char command;
-    unsigned long address;
-    int size;
-
-    while(fscanf(trace_fp, " %c %lx,%d", &command, &address, &size) == 3){
-        switch(command){
-            //skip I, only parse S L or M
-            case 'I':
-                break;
-            case 'L':
-                access_data(address);
-                for(int i=1; i<size; i++){
-                    if((address+i)%B == 0){
-                        access_data(address+i);
-                    }
-                }
-                break;
-            case 'S':
-                access_data(address);
-                for(int i=1; i<size; i++){
-                    if((address+i)%B == 0){
-                        access_data(address+i);
-                    }
-                }
-                break;
-            case 'M':
-                access_data(address);
-                access_data(address);
-                for(int i=1; i<size; i++){
-                    if((address+i)%B == 0){
-                        access_data(address+i);
-                        access_data(address+i);
-                    }
-                }
-                break;
-            default:
-                break;
+    PROFILE_START(lap);
+    if (policy != OPT) {
+        while (next_record(&r)) {
+            PROFILE_LAP(prof.parse, lap);
+            replay_record(&r);
+            PROFILE_LAP(prof.simulate, lap);
+        }
+        PROFILE_LAP(prof.parse, lap);
+        return;
+    }
+
+    unsigned long n = 0;
+    unsigned long capacity = 1 << 16;
+    TraceRecord *records = xcalloc(capacity, sizeof(TraceRecord));
+    while (next_record(&records[n])) {
+        if (records[n].op != 'I')
+            access_range(records[n].address, records[n].size, records[n].op, opt_record);
+        if (++n == capacity) {
+            capacity *= 2;
+            records = realloc(records, capacity * sizeof(TraceRecord));
+            if (records == NULL) {
+                fprintf(stderr, "ERROR: out of memory\n");
+                exit(1);
+            }
+        }
+    }
+    opt_plan();
+    PROFILE_LAP(prof.parse, lap);  // decoding and planning
+    for (unsigned long i = 0; i < n; i++) {
+        replay_record(&records[i]);
+    }
+    PROFILE_LAP(prof.simulate, lap);
+    opt_free();
+    free(records);
+}
+
+/**
+ * Set-partitioned trace index (--index-out, --index).
+ *
+ * The index stores the data accesses of a trace for one S and B, grouped by
+ * set, so a run can skip trace parsing and address decoding entirely. Within
+ * a set, each access is a LEB128 varint of (zigzag(tag - previous tag) << 1 |
+ * write), which takes a byte or two for typical traces:
+ *
+ *   IndexHeader
+ *   uint64_t offset[S + 1]     byte offset of the entries of each set
+ *   uint64_t count[S]          accesses of each set
+ *   entries
+ *
+ * A set's hits and misses only depend on its own accesses, so the replay maps
+ * the file, hands contiguous ranges of sets to `threads` threads with private
+ * caches and adds up their counters.
+ */
+#define INDEX_MAGIC "CSIMIDX1"
+
+typedef struct {
+    char magic[8];
+    uint32_t S;
+    uint32_t B;
+    uint64_t accesses;
+} IndexHeader;
+
+typedef struct {
+    uint8_t *data;
+    size_t length;
+    size_t capacity;
+    unsigned long tag;          // tag of the last access
+    unsigned long count;
+} IndexSet;
+
+IndexSet *index_sets;
+unsigned long index_accesses = 0;
+
+static void index_visit(unsigned long addr, unsigned long bytes, int write) {
+    (void)bytes;
+    unsigned long line = addr >> blockOffsetBit;
+    IndexSet *set = &index_sets[line & (S - 1)];
+    unsigned long tag = line >> setIndexBit;
+    long delta = (long)(tag - set->tag);
+    unsigned long zz = ((unsigned long)delta << 1) ^ (unsigned long)(delta >> 63);
+    unsigned long v = zz << 1 | (write != 0);
+    if (set->capacity - set->length < 10) {
+        set->capacity = set->capacity ? 2 * set->capacity : 64;
+        set->data = realloc(set->data, set->capacity);
+        if (set->data == NULL) {
+            fprintf(stderr, "ERROR: out of memory\n");
+            exit(1);
+        }
+    }
+    while (v >= 0x80) {
+        set->data[set->length++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    set->data[set->length++] = (uint8_t)v;
+    set->tag = tag;
+    set->count++;
+    index_accesses++;
+}
+
+/* Write the index of the trace(s) for the configured S and B to `index_out` */
+static void write_index() {
+    TraceRecord r;
+    index_sets = xcalloc(S, sizeof(IndexSet));
+    while (next_record(&r)) {
+        if (r.op != 'I')
+            access_range(r.address, r.size, r.op, index_visit);
+    }
+
+    FILE *fp = fopen(index_out, "wb");
+    if (!fp) {
+        fprintf(stderr, "ERROR: %s: %s\n", index_out, strerror(errno));
+        exit(1);
+    }
+    IndexHeader h = {INDEX_MAGIC, S, B, index_accesses};
+    fwrite(&h, sizeof(h), 1, fp);
+    uint64_t offset = 0;
+    for (int i = 0; i <= S; i++) {
+        fwrite(&offset, sizeof(offset), 1, fp);
+        if (i < S)
+            offset += index_sets[i].length;
+    }
+    for (int i = 0; i < S; i++) {
+        uint64_t count = index_sets[i].count;
+        fwrite(&count, sizeof(count), 1, fp);
+    }
+    for (int i = 0; i < S; i++) {
+        fwrite(index_sets[i].data, 1, index_sets[i].length, fp);
+        free(index_sets[i].data);
+    }
+    if (fclose(fp)) {
+        fprintf(stderr, "ERROR: %s: %s\n", index_out, strerror(errno));
+        exit(1);
+    }
+    free(index_sets);
+    printf("index sets:%d accesses:%lu bytes:%lu\n", S, index_accesses,
+           (unsigned long)(sizeof(h) + (2 * (unsigned long)S + 1) * sizeof(uint64_t) + offset));
+}
+
+typedef struct {
+    const uint8_t *entries;
+    const uint64_t *offset;
+    unsigned long first;        // sets [first, last) of this thread
+    unsigned long last;
+    myCache cache;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long writebacks;
+    unsigned long lookups;      // --profile counters of the thread
+    unsigned long ways;
+} IndexJob;
+
+static void *replay_sets(void *arg) {
+    IndexJob *job = arg;
+    myCache *c = &job->cache;
+    unsigned long lookups = prof_lookups;
+    unsigned long ways = prof_ways;
+    for (unsigned long set = job->first; set < job->last; set++) {
+        const uint8_t *p = job->entries + job->offset[set];
+        const uint8_t *end = job->entries + job->offset[set + 1];
+        unsigned long tag = 0;
+        while (p < end) {
+            unsigned long v = 0;
+            int shift = 0;
+            do {
+                v |= (unsigned long)(*p & 0x7f) << shift;
+                shift += 7;
+            } while (*p++ & 0x80);
+            unsigned long zz = v >> 1;
+            tag += (zz >> 1) ^ -(zz & 1);
+            int outcome = c->kernel(c, (tag << setIndexBit) | set, v & 1);
+            job->hits += outcome == ACCESS_HIT;
+            job->misses += outcome & 1;
+            job->evictions += (outcome >> 1) & 1;
+            job->writebacks += outcome >> 2;
         }
     }
+    job->lookups = prof_lookups - lookups;
+    job->ways = prof_ways - ways;
+    return NULL;
+}
+
+/* Replay the sets `index_first..index_last` of the index at `index_in` */
+static void replay_index() {
+    int fd = open(index_in, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "ERROR: %s: %s\n", index_in, strerror(errno));
+        exit(1);
+    }
+    size_t size = st.st_size;
+    const IndexHeader *h = NULL;
+    size_t table = (2 * (size_t)S + 1) * sizeof(uint64_t);
+    if (size >= sizeof(IndexHeader))
+        h = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (h == NULL || h == MAP_FAILED || memcmp(h->magic, INDEX_MAGIC, 8) ||
+        h->S != (uint32_t)S || h->B != (uint32_t)B || size < sizeof(IndexHeader) + table) {
+        fprintf(stderr, "ERROR: %s is not an index for S=%d B=%d\n", index_in, S, B);
+        exit(1);
+    }
+    close(fd);
+    const uint64_t *offset = (const uint64_t *)(h + 1);
+    const uint8_t *entries = (const uint8_t *)h + sizeof(IndexHeader) + table;
+    if (offset[S] > size - sizeof(IndexHeader) - table) {
+        fprintf(stderr, "ERROR: %s is truncated\n", index_in);
+        exit(1);
+    }
 
+    unsigned long first = index_first;
+    unsigned long last = index_last < (unsigned long)S ? index_last + 1 : (unsigned long)S;
+    unsigned long nthreads = threads < last - first ? threads : (last > first ? last - first : 1);
+    IndexJob *jobs = xcalloc(nthreads, sizeof(IndexJob));
+    pthread_t *tids = xcalloc(nthreads, sizeof(pthread_t));
+    for (unsigned long i = 0; i < nthreads; i++) {
+        jobs[i].entries = entries;
+        jobs[i].offset = offset;
+        jobs[i].first = first + (last - first) * i / nthreads;
+        jobs[i].last = first + (last - first) * (i + 1) / nthreads;
+        allocate_cache(&jobs[i].cache, "L1D", S, K, B, policy, 0, 0, HASH_BITS);
+        select_kernel(&jobs[i].cache);
+        if (i > 0 && pthread_create(&tids[i], NULL, replay_sets, &jobs[i])) {
+            fprintf(stderr, "ERROR: cannot create thread\n");
+            exit(1);
+        }
+    }
+    replay_sets(&jobs[0]);
+    for (unsigned long i = 0; i < nthreads; i++) {
+        if (i > 0) {
+            pthread_join(tids[i], NULL);
+            prof_lookups += jobs[i].lookups;  // thread 0 counted into ours
+            prof_ways += jobs[i].ways;
+        }
+        hit_count += jobs[i].hits;
+        miss_count += jobs[i].misses;
+        eviction_count += jobs[i].evictions;
+        writeback_count += jobs[i].writebacks;
+        free_cache(&jobs[i].cache);
+    }
+    // pages of the L1D that a single cache would have touched
+    for (unsigned long set = first, page = ULONG_MAX; set < last; set++) {
+        if (offset[set + 1] > offset[set] && set >> cache.pageShift != page) {
+            page = set >> cache.pageShift;
+            cache.pagesTouched++;
+        }
+    }
+    free(jobs);
+    free(tids);
+    munmap((void *)h, size);
+}
+
+/* Print the --profile report of a run that started at `start` */
+static void print_profile(const struct timespec *start, unsigned long start_ticks) {
+    double parse = 0.0, simulate = 0.0;
+#ifdef CSIM_PROFILE
+    struct timespec end;
+    timespec_get(&end, TIME_UTC);
+    double wall = (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) * 1e-9;
+    unsigned long ticks = profile_ticks() - start_ticks;
+    double seconds_per_tick = ticks ? wall / ticks : 0.0;
+    parse = prof.parse * seconds_per_tick;
+    simulate = prof.simulate * seconds_per_tick;
+#else
+    (void)start;
+    (void)start_ticks;
+#endif
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    unsigned long accesses = hit_count + miss_count;
+    fprintf(stderr, "profile parse_s:%.3f simulate_s:%.3f accesses:%lu accesses_per_s:%.0f "
+            "ways_per_lookup:%.2f evictions_per_decision:%.3f peak_rss_kb:%ld\n",
+            parse, simulate, accesses, simulate > 0.0 ? accesses / simulate : 0.0,
+            prof_lookups ? (double)prof_ways / prof_lookups : 0.0,
+            miss_count ? (double)eviction_count / miss_count : 0.0, usage.ru_maxrss);
 }
 
 /**
  * Print cache statistics (DO NOT MODIFY).
  */
-static void print_summary(int hits, int misses, int evictions) {
-    printf("hits:%d misses:%d evictions:%d\n", hits, misses, evictions);
+static void print_summary(unsigned long hits, unsigned long misses, unsigned long evictions) {
+    printf("hits:%lu misses:%lu evictions:%lu\n", hits, misses, evictions);
+}
+
+/* Print the counters of an extra cache level, after the L1 data cache summary */
+static void print_level_summary(const myCache *c) {
+    printf("%s hits:%lu misses:%lu evictions:%lu\n", c->name, c->hits, c->misses, c->evictions);
+    if (verbose) {
+        printf("%s writebacks:%lu pages:%lu/%lu\n", c->name, c->writebacks,
+               c->pagesTouched, c->npages);
+    }
+}
+
+/* Allocate empty caches for the configured levels and zero the L1D counters */
+static void setup_caches() {
+    allocate_cache(&cache, "L1D", S, K, B, policy, sectorSize, nstreams > 1, setHash);  // allocate data structures of cache
+    select_kernel(&cache);        // pick the access kernel for K and policy
+    if (icache_spec.S) {
+        allocate_cache(&icache, "L1I", icache_spec.S, icache_spec.K, icache_spec.B, icache_spec.policy, 0, 0, HASH_BITS);
+        select_kernel(&icache);
+    }
+    if (l2_spec.S) {
+        allocate_cache(&l2cache, "L2", l2_spec.S, l2_spec.K, l2_spec.B, l2_spec.policy, 0, 0, HASH_BITS);
+        select_kernel(&l2cache);
+        cache.next = &l2cache;
+        icache.next = &l2cache;
+    }
+    hit_count = miss_count = eviction_count = 0;
+    writeback_count = 0;
+}
+
+static void free_caches() {
+    free_cache(&cache);
+    if (icache_spec.S)
+        free_cache(&icache);
+    if (l2_spec.S)
+        free_cache(&l2cache);
+}
+
+/* Feed one access of a built-in kernel to the simulator, like a trace record */
+static void kernel_emit(unsigned long addr, unsigned int size, char op) {
+    access_range(addr, size, op, simulate);
+}
+
+/**
+ * Run the kernel with every candidate tile size on cold caches and keep the
+ * one with the fewest L1D misses (the smallest tile on ties). Candidates are
+ * the powers of 2 and 1.5 times them up to n, which covers the usual block
+ * shapes at a few dozen simulations. The caches are left holding the run of
+ * the best tile, so the summary below reports it.
+ */
+static int autotune_tile() {
+    int best = 1;
+    unsigned long best_misses = ULONG_MAX;
+    for (int pow = 1; pow <= kernelN; pow *= 2) {
+        for (int tile = pow; tile <= pow + pow / 2 && tile <= kernelN; tile += pow / 2) {
+            free_caches();
+            setup_caches();
+            workload->run(kernelN, tile, kernel_emit);
+            printf("tile:%d hits:%lu misses:%lu evictions:%lu\n", tile, hit_count, miss_count,
+                   eviction_count);
+            if (miss_count < best_misses) {
+                best = tile;
+                best_misses = miss_count;
+            }
+            if (pow == 1)
+                break;
+        }
+    }
+    free_caches();
+    setup_caches();
+    workload->run(kernelN, best, kernel_emit);
+    return best;
 }
 
 int main(int argc, char **argv) {
     parse_arguments(argc, argv);  // set global variables used by simulation
-    allocate_cache();             // allocate data structures of cache
-    replay_trace();               // simulate the trace and update counts
-    free_cache();                 // deallocate data structures of cache
-    fclose(trace_fp);             // close trace file
+    for (int i = 0; i < nstreams; i++)
+        streams[i].dec = decoder_open(streams[i].fp);  // detect the trace formats
+    if (shm_name) {
+        shm_ring = csim_shm_attach(shm_name);  // waits for the producer
+        if (!shm_ring) {
+            fprintf(stderr, "ERROR: %s: %s\n", shm_name, strerror(errno));
+            exit(1);
+        }
+    }
+    struct timespec start;
+    timespec_get(&start, TIME_UTC);
+    unsigned long start_ticks = 0;
+#ifdef CSIM_PROFILE
+    start_ticks = profile_ticks();
+#endif
+    if (index_out) {
+        write_index();            // index the trace instead of simulating it
+        for (int i = 0; i < nstreams; i++)
+            decoder_close(streams[i].dec);
+        if (shm_ring)
+            csim_shm_detach(shm_ring);
+        return 0;
+    }
+    setup_caches();
+    if (timing)
+        timing_init();
+    if (mrcRate)
+        shards_init();
+    if (topN) {
+        top_init(&top_lines);
+        top_init(&top_sets);
+    }
+    if (region_path)
+        regions_init();
+    if (window_len)
+        window_start();           // write the time-series header
+    int best_tile = 0;
+    if (workload || index_in) {
+        PROFILE_START(lap);       // nothing to parse
+        if (autotune)
+            best_tile = autotune_tile();
+        else if (workload)
+            workload->run(kernelN, kernelTile, kernel_emit);
+        else
+            replay_index();       // replay the indexed sets
+        PROFILE_LAP(prof.simulate, lap);
+    }
+    else {
+        replay_trace();           // simulate the trace and update counts
+    }
+    if (window_len)
+        window_finish();          // flush the last partial window
+    for (int i = 0; i < nstreams; i++)
+        decoder_close(streams[i].dec);  // close trace files
+    if (shm_ring)
+        csim_shm_detach(shm_ring);
     print_summary(hit_count, miss_count, eviction_count);  // print counts
+    if (autotune)
+        printf("best_tile:%d\n", best_tile);
+    if (profile)
+        print_profile(&start, start_ticks);
+    if (verbose) {
+        printf("writebacks:%lu pages:%lu/%lu\n", writeback_count,
+               cache.pagesTouched, cache.npages);
+    }
+    if (nstreams > 1) {
+        for (int i = 0; i < nstreams; i++) {
+            printf("stream:%d hits:%lu misses:%lu evictions:%lu evicted_by_others:%lu trace:%s\n", i,
+                   streams[i].hits, streams[i].misses, streams[i].evictions, streams[i].evicted,
+                   streams[i].path);
+        }
+    }
+    if (region_path)
+        regions_print();
+    if (sectorSize) {
+        printf("sector_misses:%lu bytes_fetched:%lu unsectored_bytes:%lu\n",
+               cache.sectorMisses, cache.bytesFetched, miss_count * B);
+    }
+    if (wss) {
+        unsigned long lines = hll_estimate(&wss_total.lines);
+        printf("wss_lines:%lu wss_pages:%lu wss_bytes:%lu\n", lines,
+               hll_estimate(&wss_total.pages), lines * B);
+    }
+    if (mrcRate) {
+        shards_print();
+        shards_free();
+    }
+    if (topN) {
+        top_print();
+        top_free(&top_lines);
+        top_free(&top_sets);
+    }
+    if (timing) {
+        printf("cycles:%lu amat:%.2f mshr_merges:%lu mshr_stalls:%lu\n", tm.end,
+               tm.accesses ? (double)tm.latency / tm.accesses : 0.0, tm.merges, tm.stalls);
+        free(tm.fills);
+        linemap_free(&tm.inflight);
+    }
+    if (icache_spec.S) {
+        print_level_summary(&icache);
+        free_cache(&icache);
+    }
+    if (l2_spec.S) {
+        print_level_summary(&l2cache);
+        free_cache(&l2cache);
+    }
+    free_cache(&cache);           // deallocate data structures of cache
     return 0;
 }
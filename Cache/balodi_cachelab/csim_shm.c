@@ -0,0 +1,180 @@
+#define _POSIX_C_SOURCE 200809L  // shm_open, ftruncate, nanosleep
+
+#include <errno.h>   // errno, ENOENT
+#include <fcntl.h>   // O_* flags
+#include <sched.h>   // sched_yield
+#include <stdatomic.h>
+#include <stdlib.h>  // malloc, free
+#include <string.h>  // strlen, strcpy
+#include <sys/mman.h>  // shm_open, shm_unlink, mmap, munmap
+#include <sys/stat.h>  // fstat
+#include <time.h>    // nanosleep
+#include <unistd.h>  // ftruncate, close
+
+#include "csim_shm.h"
+
+#define CACHE_LINE 64
+#define RING_MAGIC 0x314d48534d495343UL  // "CSIMSHM1" in little-endian
+
+/**
+ * Layout of the shared memory: this header, then `capacity` records. Each
+ * index has a cache line to itself, so the producer storing `head` and the
+ * consumer storing `tail` never invalidate each other's line. Indices only
+ * grow; a record lives in slot index & (capacity - 1).
+ */
+typedef struct {
+    _Atomic uint64_t magic;     // set last by the producer, once the ring is ready
+    uint64_t capacity;
+    _Alignas(CACHE_LINE) _Atomic uint64_t head;    // records pushed (producer)
+    _Alignas(CACHE_LINE) _Atomic uint64_t tail;    // records popped (consumer)
+    _Alignas(CACHE_LINE) _Atomic uint32_t closed;  // 1 after the last push
+} RingHeader;
+
+/* Process-local view of a ring */
+struct CsimShm {
+    RingHeader *header;
+    CsimShmRecord *records;
+    uint64_t mask;              // capacity - 1
+    uint64_t index;             // our own index (head or tail)
+    uint64_t other;             // last seen index of the other side
+    size_t size;                // bytes mapped
+    char *name;
+};
+
+/* Back off while the other side is busy: spin politely, then sleep */
+static void ring_wait(unsigned *spins) {
+    if (++*spins < 64) {
+        sched_yield();
+    }
+    else {
+        struct timespec ts = {0, 50000};  // 50 us
+        nanosleep(&ts, NULL);
+    }
+}
+
+static CsimShm *ring_map(const char *name, int fd, size_t size) {
+    void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return NULL;
+    CsimShm *ring = malloc(sizeof(CsimShm));
+    char *copy = malloc(strlen(name) + 1);
+    if (ring == NULL || copy == NULL) {
+        free(ring);
+        free(copy);
+        munmap(base, size);
+        return NULL;
+    }
+    ring->header = base;
+    ring->records = (CsimShmRecord *)((char *)base + sizeof(RingHeader));
+    ring->size = size;
+    ring->name = strcpy(copy, name);
+    ring->index = 0;
+    ring->other = 0;
+    return ring;
+}
+
+CsimShm *csim_shm_create(const char *name, size_t capacity) {
+    uint64_t cap = 1;
+    while (cap < capacity)
+        cap <<= 1;
+    size_t size = sizeof(RingHeader) + cap * sizeof(CsimShmRecord);
+
+    shm_unlink(name);  // a ring left behind by a run that crashed
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0)
+        return NULL;
+    if (ftruncate(fd, size) < 0) {
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+    CsimShm *ring = ring_map(name, fd, size);
+    if (ring == NULL) {
+        shm_unlink(name);
+        return NULL;
+    }
+    ring->mask = cap - 1;
+    ring->header->capacity = cap;
+    atomic_store_explicit(&ring->header->magic, RING_MAGIC, memory_order_release);
+    return ring;
+}
+
+void csim_shm_push(CsimShm *ring, char op, uint64_t address, uint32_t size) {
+    // re-read the consumer's tail only when the cached one says the ring is full
+    unsigned spins = 0;
+    while (ring->index - ring->other > ring->mask) {
+        ring->other = atomic_load_explicit(&ring->header->tail, memory_order_acquire);
+        if (ring->index - ring->other > ring->mask)
+            ring_wait(&spins);
+    }
+    CsimShmRecord *r = &ring->records[ring->index & ring->mask];
+    r->address = address;
+    r->size = size;
+    r->op = op;
+    atomic_store_explicit(&ring->header->head, ++ring->index, memory_order_release);
+}
+
+void csim_shm_close(CsimShm *ring) {
+    atomic_store_explicit(&ring->header->closed, 1, memory_order_release);
+    munmap(ring->header, ring->size);
+    free(ring->name);
+    free(ring);
+}
+
+CsimShm *csim_shm_attach(const char *name) {
+    unsigned spins = 0;
+    int fd;
+    struct stat st;
+    for (;;) {
+        fd = shm_open(name, O_RDWR, 0);
+        if (fd < 0 && errno != ENOENT)
+            return NULL;
+        if (fd >= 0) {
+            if (fstat(fd, &st) < 0) {
+                close(fd);
+                return NULL;
+            }
+            if ((size_t)st.st_size >= sizeof(RingHeader))
+                break;
+            close(fd);  // created but not sized yet
+        }
+        ring_wait(&spins);
+    }
+    CsimShm *ring = ring_map(name, fd, st.st_size);
+    if (ring == NULL)
+        return NULL;
+    while (atomic_load_explicit(&ring->header->magic, memory_order_acquire) != RING_MAGIC)
+        ring_wait(&spins);
+    ring->mask = ring->header->capacity - 1;
+    return ring;
+}
+
+size_t csim_shm_pop(CsimShm *ring, CsimShmRecord *out, size_t max) {
+    unsigned spins = 0;
+    while (ring->other == ring->index) {
+        // check `closed` before `head`, so pushes made before closing are seen
+        int closed = atomic_load_explicit(&ring->header->closed, memory_order_acquire);
+        ring->other = atomic_load_explicit(&ring->header->head, memory_order_acquire);
+        if (ring->other != ring->index)
+            break;
+        if (closed)
+            return 0;
+        ring_wait(&spins);
+    }
+    size_t n = ring->other - ring->index;
+    if (n > max)
+        n = max;
+    for (size_t i = 0; i < n; i++)
+        out[i] = ring->records[(ring->index + i) & ring->mask];
+    ring->index += n;
+    atomic_store_explicit(&ring->header->tail, ring->index, memory_order_release);
+    return n;
+}
+
+void csim_shm_detach(CsimShm *ring) {
+    munmap(ring->header, ring->size);
+    shm_unlink(ring->name);
+    free(ring->name);
+    free(ring);
+}
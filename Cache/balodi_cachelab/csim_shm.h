@@ -0,0 +1,56 @@
+#ifndef CSIM_SHM_H
+#define CSIM_SHM_H
+
+#include <stddef.h>  // size_t
+#include <stdint.h>  // uint32_t, uint64_t
+
+/**
+ * Shared-memory trace ring between an instrumented program (the producer)
+ * and `csim --shm <name>` (the consumer).
+ *
+ * The producer creates the ring and pushes one record per memory access:
+ *
+ *   CsimShm *ring = csim_shm_create("/mytrace", 1 << 16);
+ *   csim_shm_push(ring, 'L', (uint64_t)p, sizeof(*p));
+ *   ...
+ *   csim_shm_close(ring);
+ *
+ * and csim replays them as they arrive, in the same way as the lines of a
+ * lackey trace. The ring is single-producer single-consumer and lock-free:
+ * the head (next slot to write) and tail (next slot to read) live on separate
+ * cache lines and each side only writes its own. A push into a full ring
+ * waits for csim to catch up, so the producer runs at simulation speed and
+ * nothing is ever dropped.
+ */
+
+/* One access, as in a lackey trace line ` <op> <address>,<size>` */
+typedef struct {
+    uint64_t address;
+    uint32_t size;
+    char op;                    // 'I', 'L', 'S', 'M' or 'R'
+} CsimShmRecord;
+
+typedef struct CsimShm CsimShm;
+
+/* Producer: create the ring `name` (a POSIX shm name like "/trace") with room
+ * for `capacity` records, rounded up to a power of 2. Returns NULL on error. */
+CsimShm *csim_shm_create(const char *name, size_t capacity);
+
+/* Producer: append a record, waiting while the ring is full. */
+void csim_shm_push(CsimShm *ring, char op, uint64_t address, uint32_t size);
+
+/* Producer: mark the end of the trace and unmap the ring. */
+void csim_shm_close(CsimShm *ring);
+
+/* Consumer: attach to the ring `name`, waiting for the producer to create it.
+ * Returns NULL on error. */
+CsimShm *csim_shm_attach(const char *name);
+
+/* Consumer: copy up to `max` records into `out`, waiting until at least one
+ * is available. Returns 0 once the producer closed the ring and it is empty. */
+size_t csim_shm_pop(CsimShm *ring, CsimShmRecord *out, size_t max);
+
+/* Consumer: unmap the ring and remove its name. */
+void csim_shm_detach(CsimShm *ring);
+
+#endif
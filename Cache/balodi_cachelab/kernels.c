@@ -0,0 +1,120 @@
+#include <stddef.h>  // NULL
+#include <string.h>  // strcmp
+
+#include "kernels.h"
+
+/* Matrices start on distinct 256 MB boundaries, so equal indices alias in every set */
+#define MATRIX_A 0x10000000UL
+#define MATRIX_B 0x20000000UL
+#define MATRIX_C 0x30000000UL
+
+#define AT(base, i, j, n) ((base) + ((unsigned long)(i) * (n) + (j)) * KERNEL_ELEM)
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+
+/* B = A^T, row by row */
+static void transpose(int n, int tile, KernelEmit emit) {
+    (void)tile;
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < n; j++) {
+            emit(AT(MATRIX_A, i, j, n), KERNEL_ELEM, 'L');
+            emit(AT(MATRIX_B, j, i, n), KERNEL_ELEM, 'S');
+        }
+    }
+}
+
+/* B = A^T, one tile x tile block at a time */
+static void transpose_tiled(int n, int tile, KernelEmit emit) {
+    for (int ii = 0; ii < n; ii += tile) {
+        for (int jj = 0; jj < n; jj += tile) {
+            for (int i = ii; i < MIN(ii + tile, n); i++) {
+                for (int j = jj; j < MIN(jj + tile, n); j++) {
+                    emit(AT(MATRIX_A, i, j, n), KERNEL_ELEM, 'L');
+                    emit(AT(MATRIX_B, j, i, n), KERNEL_ELEM, 'S');
+                }
+            }
+        }
+    }
+}
+
+/* C = A * B in i-j-k order, accumulating each C[i][j] in a register */
+static void matmul(int n, int tile, KernelEmit emit) {
+    (void)tile;
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < n; j++) {
+            for (int k = 0; k < n; k++) {
+                emit(AT(MATRIX_A, i, k, n), KERNEL_ELEM, 'L');
+                emit(AT(MATRIX_B, k, j, n), KERNEL_ELEM, 'L');
+            }
+            emit(AT(MATRIX_C, i, j, n), KERNEL_ELEM, 'S');
+        }
+    }
+}
+
+/* C = A * B blocked on i, j and k; partial sums of later k blocks update C */
+static void matmul_tiled(int n, int tile, KernelEmit emit) {
+    for (int ii = 0; ii < n; ii += tile) {
+        for (int jj = 0; jj < n; jj += tile) {
+            for (int kk = 0; kk < n; kk += tile) {
+                for (int i = ii; i < MIN(ii + tile, n); i++) {
+                    for (int j = jj; j < MIN(jj + tile, n); j++) {
+                        for (int k = kk; k < MIN(kk + tile, n); k++) {
+                            emit(AT(MATRIX_A, i, k, n), KERNEL_ELEM, 'L');
+                            emit(AT(MATRIX_B, k, j, n), KERNEL_ELEM, 'L');
+                        }
+                        emit(AT(MATRIX_C, i, j, n), KERNEL_ELEM, kk == 0 ? 'S' : 'M');
+                    }
+                }
+            }
+        }
+    }
+}
+
+/* One 5-point Jacobi sweep of the interior of A into B */
+static void stencil_point(int n, int i, int j, KernelEmit emit) {
+    emit(AT(MATRIX_A, i - 1, j, n), KERNEL_ELEM, 'L');
+    emit(AT(MATRIX_A, i, j - 1, n), KERNEL_ELEM, 'L');
+    emit(AT(MATRIX_A, i, j, n), KERNEL_ELEM, 'L');
+    emit(AT(MATRIX_A, i, j + 1, n), KERNEL_ELEM, 'L');
+    emit(AT(MATRIX_A, i + 1, j, n), KERNEL_ELEM, 'L');
+    emit(AT(MATRIX_B, i, j, n), KERNEL_ELEM, 'S');
+}
+
+static void stencil(int n, int tile, KernelEmit emit) {
+    (void)tile;
+    for (int i = 1; i < n - 1; i++) {
+        for (int j = 1; j < n - 1; j++)
+            stencil_point(n, i, j, emit);
+    }
+}
+
+/* The same sweep over tile x tile blocks of the interior */
+static void stencil_tiled(int n, int tile, KernelEmit emit) {
+    for (int ii = 1; ii < n - 1; ii += tile) {
+        for (int jj = 1; jj < n - 1; jj += tile) {
+            for (int i = ii; i < MIN(ii + tile, n - 1); i++) {
+                for (int j = jj; j < MIN(jj + tile, n - 1); j++)
+                    stencil_point(n, i, j, emit);
+            }
+        }
+    }
+}
+
+static const Kernel kernels[] = {
+    {"transpose",       transpose,       0},
+    {"transpose-tiled", transpose_tiled, 1},
+    {"matmul",          matmul,          0},
+    {"matmul-tiled",    matmul_tiled,    1},
+    {"stencil",         stencil,         0},
+    {"stencil-tiled",   stencil_tiled,   1},
+};
+
+const char kernel_names[] =
+    "transpose transpose-tiled matmul matmul-tiled stencil stencil-tiled";
+
+const Kernel *find_kernel(const char *name) {
+    for (size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+        if (!strcmp(kernels[i].name, name))
+            return &kernels[i];
+    }
+    return NULL;
+}
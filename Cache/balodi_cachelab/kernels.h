@@ -0,0 +1,31 @@
+#ifndef KERNELS_H
+#define KERNELS_H
+
+/**
+ * Reference kernels that report their memory accesses instead of running.
+ *
+ * Each kernel walks n x n matrices of KERNEL_ELEM-byte elements laid out at
+ * fixed virtual addresses and calls `emit` for every element it would load
+ * (`L`), store (`S`) or update in place (`M`), in loop order. Only these
+ * matrix data references are emitted: there are no instruction fetches, stack
+ * traffic or loop-variable accesses, which a trace of the real loop would
+ * also contain.
+ */
+#define KERNEL_ELEM 8   // bytes per matrix element (double)
+#define KERNEL_MAX_N 5792  // largest n whose matrix fits in the 256 MB between two matrices
+
+typedef void (*KernelEmit)(unsigned long addr, unsigned int size, char op);
+
+typedef struct {
+    const char *name;
+    void (*run)(int n, int tile, KernelEmit emit);
+    int tiled;          // 1 if the kernel is blocked by `tile`
+} Kernel;
+
+/* Return the kernel called `name`, or NULL if there is none */
+const Kernel *find_kernel(const char *name);
+
+/* Space-separated names of all kernels, for usage messages */
+extern const char kernel_names[];
+
+#endif
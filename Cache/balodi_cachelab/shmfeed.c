@@ -0,0 +1,46 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>   // fopen, fgets, sscanf, fprintf
+#include <stdlib.h>  // exit
+#include <string.h>  // strerror
+#include <errno.h>   // errno
+
+#include "csim_shm.h"
+
+/**
+ * Push the records of a lackey trace to a csim_shm ring, as an instrumented
+ * program would, so `csim --shm` can be tried (and tested) without one:
+ *
+ *   $ ./shmfeed /trace traces/yi.trace & ./csim -S 16 -K 1 -B 16 -p LRU --shm /trace
+ *
+ * The ring is small, so a long trace wraps around it many times.
+ */
+#define FEED_CAPACITY 1024
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: shmfeed <name> <trace>\n");
+        exit(1);
+    }
+    FILE *fp = fopen(argv[2], "r");
+    if (!fp) {
+        fprintf(stderr, "ERROR: %s: %s\n", argv[2], strerror(errno));
+        exit(1);
+    }
+    CsimShm *ring = csim_shm_create(argv[1], FEED_CAPACITY);
+    if (!ring) {
+        fprintf(stderr, "ERROR: %s: %s\n", argv[1], strerror(errno));
+        exit(1);
+    }
+    char buf[256];
+    while (fgets(buf, sizeof(buf), fp)) {
+        char op;
+        unsigned long address;
+        unsigned int size;
+        if (sscanf(buf, " %c %lx,%u", &op, &address, &size) == 3)
+            csim_shm_push(ring, op, address, size);
+    }
+    csim_shm_close(ring);
+    fclose(fp);
+    return 0;
+}
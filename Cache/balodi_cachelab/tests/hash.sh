@@ -0,0 +1,7 @@
+./csim -S 16 -K 2 -B 16 -p LRU --set-hash xor -t traces/long.trace
+./csim -S 13 -K 2 -B 16 -p LRU --set-hash prime -t traces/long.trace
+./csim -S 16 -K 4 -B 16 -p LRU --set-hash skew -t traces/long.trace
+./csim -S 8 -K 2 -B 16 -p FIFO --set-hash skew -t traces/trans.trace
+./csim -S 5 -K 1 -B 32 -p FIFO --set-hash prime -t traces/trans.trace
+./csim -S 32 -K 1 -B 16 -p LRU --set-hash xor -t traces/trans.trace
+./csim -S 16 -K 1 -B 16 -p LRU --set-hash prime -t traces/trans.trace 2>&1
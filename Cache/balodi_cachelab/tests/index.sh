@@ -0,0 +1,8 @@
+./csim -S 16 -B 32 --index-out tests/long.idx -t traces/long.trace
+./csim -S 16 -K 2 -B 32 -p LRU -t traces/long.trace
+./csim -S 16 -K 2 -B 32 -p LRU --index tests/long.idx
+./csim -S 16 -K 2 -B 32 -p LRU --index tests/long.idx --threads 4
+./csim -S 16 -K 4 -B 32 -p FIFO -t traces/long.trace
+./csim -S 16 -K 4 -B 32 -p FIFO --index tests/long.idx --threads 3
+./csim -S 16 -K 4 -B 32 -p FIFO --index tests/long.idx --sets 0-7
+./csim -S 16 -K 4 -B 32 -p FIFO --index tests/long.idx --sets 8-15 --threads 2
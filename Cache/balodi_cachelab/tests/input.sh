@@ -0,0 +1,10 @@
+./csim -S 16 -K 2 -B 16 -p LRU -t traces/long.trace
+./shmfeed /csim_grade traces/long.trace & ./csim -S 16 -K 2 -B 16 -p LRU --shm /csim_grade
+./csim -S 4 -K 2 -B 16 -p OPT --icache 4,2,16 -t traces/trans.trace
+./shmfeed /csim_grade traces/trans.trace & ./csim -S 4 -K 2 -B 16 -p LRU --icache 4,2,16 --shm /csim_grade
+./csim -S 4 -K 2 -B 16 -p OPT --shm /csim_grade 2>&1
+./csim -S 4 -K 2 -B 16 -p LRU --icache 4,2,16 --l2 16,4,16 -t traces/trans.trace
+./csim -S 4 -K 2 -B 16 -p LRU --icache 4,2,16 --l2 16,4,16 -t traces/trans.drmemtrace
+./csim -S 4 -K 2 -B 16 -p LRU --icache 4,2,16 --l2 16,4,16 --format drmemtrace -t traces/trans.drmemtrace
+./csim -S 4 -K 2 -B 16 -p LRU --icache 4,2,16 --l2 16,4,16 -t traces/trans.pin
+./csim -S 4 -K 2 -B 16 -p LRU --icache 4,2,16 --l2 16,4,16 --format pin -t traces/trans.pin
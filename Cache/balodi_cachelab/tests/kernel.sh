@@ -0,0 +1,8 @@
+./csim -S 32 -K 4 -B 32 -p LRU --kernel transpose --n 32
+./csim -S 32 -K 4 -B 32 -p LRU --kernel transpose-tiled --n 32 --tile 8
+./csim -S 16 -K 2 -B 32 -p LRU --kernel matmul --n 16
+./csim -S 16 -K 2 -B 32 -p LRU --kernel matmul-tiled --n 16 --tile 4
+./csim -S 16 -K 2 -B 32 -p FIFO --kernel stencil --n 32
+./csim -S 16 -K 2 -B 32 -p FIFO --kernel stencil-tiled --n 32 --tile 8
+./csim -S 16 -K 2 -B 32 -p LRU --kernel transpose-tiled --n 32 --autotune
+./csim -S 32 -K 4 -B 32 -p LRU --kernel transpose --n 5793 2>&1
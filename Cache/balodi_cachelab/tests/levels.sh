@@ -0,0 +1,9 @@
+./csim -S 4 -K 1 -B 16 -p FIFO --l2 8,2,16,FIFO -t traces/yi.trace
+./csim -v -S 4 -K 1 -B 16 -p FIFO --l2 8,2,16,FIFO -t traces/yi.trace
+./csim -S 8 -K 2 -B 16 -p LRU --icache 8,2,16 -t traces/fifo_m2.trace
+./csim -S 4 -K 2 -B 16 -p LRU --icache 4,2,16 --l2 16,4,16 -t traces/trans.trace
+./csim -v -S 4 -K 2 -B 16 -p LRU --l2 16,4,32 -t traces/trans.trace
+./csim -S 16 -K 2 -B 16 -p LRU --l2 64,4,64 -t traces/long.trace
+./csim -S 4 -K 2 -B 32 -p LRU --sector 8 -t traces/simple_range.trace
+./csim -S 16 -K 2 -B 64 -p FIFO --sector 16 -t traces/long.trace
+./csim -S 4 -K 2 -B 32 -p LRU --sector 8 --l2 8,2,32 -t traces/trans.trace
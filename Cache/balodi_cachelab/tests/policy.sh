@@ -24,3 +24,10 @@
 ./csim -S 32 -K 2 -B 4 -p FIFO -t traces/fifo_m2_1.trace
 ./csim -S 8 -K 4 -B 4 -p FIFO -t traces/fifo_m2_1.trace
 ./csim -S 16 -K 2 -B 16 -p FIFO -t traces/fifo_l_1.trace
+./csim -S 2 -K 2 -B 2 -p OPT -t traces/simple_policy.trace
+./csim -S 16 -K 2 -B 16 -p OPT -t traces/yi.trace
+./csim -S 4 -K 4 -B 8 -p OPT -t traces/trans_1.trace
+./csim -S 8 -K 4 -B 4 -p OPT -t traces/fifo_m1.trace
+./csim -S 16 -K 2 -B 16 -p OPT -t traces/fifo_l.trace
+./csim -S 1 -K 1 -B 16 -p LRU --l2 1,8,16 -t traces/simple_writeback.trace
+./csim -S 1 -K 1 -B 16 -p OPT --l2 1,8,16 -t traces/simple_writeback.trace
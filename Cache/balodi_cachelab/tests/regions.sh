@@ -0,0 +1,4 @@
+./csim -S 4 -K 2 -B 16 -p LRU --regions traces/trans.regions -t traces/trans.trace
+./csim -S 4 -K 1 -B 16 -p LRU --regions auto -t traces/simple_regions.trace
+./csim -S 4 -K 2 -B 16 -p LRU --regions auto -t traces/trans.trace
+./csim -S 16 -K 4 -B 16 -p LRU --regions auto -t traces/long.trace
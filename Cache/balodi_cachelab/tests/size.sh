@@ -33,3 +33,6 @@
 ./csim -S 32 -K 2 -B 4 -p FIFO -t traces/fifo_m2.trace
 ./csim -S 8 -K 4 -B 4 -p FIFO -t traces/fifo_m2.trace
 ./csim -S 16 -K 2 -B 16 -p FIFO -t traces/fifo_l.trace
+./csim -S 4 -K 1 -B 8 -p LRU -t traces/simple_range.trace
+./csim -S 2 -K 2 -B 16 -p FIFO -t traces/simple_range.trace
+./csim -S 1 -K 4 -B 32 -p LRU -t traces/simple_range.trace
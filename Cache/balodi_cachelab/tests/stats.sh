@@ -0,0 +1,9 @@
+./csim -S 4 -K 2 -B 64 -p LRU --wss -t traces/trans.trace
+./csim -S 4 -K 2 -B 16 -p FIFO --wss --interval 200 -t traces/trans.trace
+./csim -S 16 -K 2 -B 16 -p LRU --wss -t traces/long.trace
+./csim -S 1 -K 4 -B 16 -p LRU --mrc 1 -t traces/trans.trace
+./csim -S 16 -K 4 -B 64 -p LRU --mrc 0.1 -t traces/long.trace
+./csim -S 16 -K 4 -B 64 -p LRU --mrc 1 --mrc-max 64 -t traces/long.trace
+./csim -S 4 -K 1 -B 16 -p LRU --top 2 -t traces/yi.trace
+./csim -S 32 -K 1 -B 32 -p LRU --top 3 -t traces/long.trace
+./csim -S 16 -K 2 -B 16 -p FIFO --top 3 -t traces/long.trace
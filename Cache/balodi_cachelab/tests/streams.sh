@@ -0,0 +1,5 @@
+./csim -S 2 -K 2 -B 16 -p LRU -t traces/stream_a.trace -t traces/stream_b.trace
+./csim -S 2 -K 2 -B 16 -p OPT -t traces/stream_a.trace -t traces/stream_b.trace
+./csim -S 4 -K 2 -B 16 -p LRU --interleave time -t traces/trans.trace -t traces/fifo_m2.trace
+./csim -S 4 -K 4 -B 16 -p LRU --way-mask 3,c -t traces/trans.trace -t traces/fifo_m2.trace
+./csim -S 16 -K 4 -B 32 -p FIFO --way-mask e,1 -t traces/long.trace -t traces/trans.trace
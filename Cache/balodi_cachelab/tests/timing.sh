@@ -0,0 +1,5 @@
+./csim -S 1 -K 1 -B 16 -p LRU --l2 2,1,16 --timing --hit-latency 1 --l2-latency 10 --mem-latency 100 --mshrs 1 -t traces/simple_timing.trace
+./csim -S 1 -K 1 -B 16 -p LRU --timing --mshrs 2 -t traces/simple_merge.trace
+./csim -S 4 -K 2 -B 16 -p LRU --timing --mshrs 2 -t traces/yi.trace
+./csim -S 16 -K 2 -B 16 -p LRU --l2 64,4,64 --timing --issue-width 2 -t traces/long.trace
+./csim -S 16 -K 4 -B 64 -p FIFO --sector 16 --l2 64,8,64 --timing --mshrs 4 -t traces/trans.trace
@@ -0,0 +1,6 @@
+./csim -S 4 -K 2 -B 16 -p LRU --interval-instr 100 -t traces/trans.trace
+./csim -S 4 -K 2 -B 16 -p LRU --interval 100 --interval-out tests/trans.win -t traces/trans.trace && cat tests/trans.win
+./csim -S 4 -K 2 -B 16 -p LRU --interval 100 --interval-format bin --interval-out tests/trans.win -t traces/trans.trace && head -c 8 tests/trans.win && echo && od -An -tu8 -w48 -j8 tests/trans.win | tr -s ' '
+./csim -S 4 -K 2 -B 16 -p LRU --interval-instr 100 --interval-format bin --interval-out tests/trans.win -t traces/trans.trace && od -An -tu8 -w48 -j8 tests/trans.win | tr -s ' '
+./csim -S 4 -K 2 -B 16 -p LRU --wss --interval-instr 200 --interval-format bin --interval-out tests/trans.win -t traces/trans.trace && head -c 8 tests/trans.win && echo && od -An -tu8 -w64 -j8 tests/trans.win | tr -s ' '
+./csim -S 4 -K 2 -B 16 -p LRU --interval 100 --interval-format bin -t traces/trans.trace 2>&1
@@ -4,25 +4,50 @@
 #include <stdlib.h>  // malloc, free, exit
 #include <unistd.h>  // _SC_PAGESIZE
 #include <errno.h>   // ENOMEM
-
-#define MAX_HEAP (20*(1<<20))  /* 20 MB */
+#include <pthread.h> // pthread_mutex_t
 
 static char *mem_start_brk;
 static char *mem_brk;
 static char *mem_max_addr;
+static pthread_mutex_t mem_lock = PTHREAD_MUTEX_INITIALIZER;  // guards mem_brk
 
 void mem_init(void) {
-    if ((mem_start_brk = (char *)malloc(MAX_HEAP)) == NULL) {
+    mem_init_threads(1);
+}
+
+/* Make room for MAX_HEAP bytes of heap per thread, for `threads` threads */
+void mem_init_threads(int threads) {
+    if (threads < 1 || threads > MAX_HEAP_THREADS) {
         fprintf(stderr, "mem_init_vm: malloc error\n");
         exit(1);
     }
+    mem_init_region((size_t)MAX_HEAP * threads);
+}
 
-    mem_max_addr = mem_start_brk + MAX_HEAP;
+/**
+ * Make room for a heap of `size` bytes, at most MAX_REGION. A region of the
+ * same size is reused; any other region is freed first, so calling this again
+ * does not leak the old one.
+ */
+void mem_init_region(size_t size) {
+    if (size == 0 || size > MAX_REGION) {
+        fprintf(stderr, "mem_init_vm: malloc error\n");
+        exit(1);
+    }
+    if (mem_start_brk == NULL || (size_t)(mem_max_addr - mem_start_brk) != size) {
+        free(mem_start_brk);
+        if ((mem_start_brk = (char *)malloc(size)) == NULL) {
+            fprintf(stderr, "mem_init_vm: malloc error\n");
+            exit(1);
+        }
+        mem_max_addr = mem_start_brk + size;
+    }
     mem_brk = mem_start_brk;
 }
 
 void mem_deinit(void) {
     free(mem_start_brk);
+    mem_start_brk = NULL;
 }
 
 void mem_reset_brk() {
@@ -30,14 +55,17 @@ void mem_reset_brk() {
 }
 
 void *mem_sbrk(int incr) {
+    pthread_mutex_lock(&mem_lock);
     char *old_brk = mem_brk;
     if (incr < 0 || (mem_brk + incr) > mem_max_addr) {
+        pthread_mutex_unlock(&mem_lock);
         errno = ENOMEM;
         fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
         return (void *)-1;
     }
 
     mem_brk += incr;
+    pthread_mutex_unlock(&mem_lock);
     return (void *)old_brk;
 }
 
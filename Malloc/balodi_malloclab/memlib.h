@@ -3,7 +3,13 @@
 
 #include <stddef.h>  // size_t
 
+#define MAX_HEAP (20*(1<<20))  /* 20 MB, the heap of one thread */
+#define MAX_REGION (640*(1<<20))  /* largest region memlib reserves; mm sizes its tables from it */
+#define MAX_HEAP_THREADS (MAX_REGION / MAX_HEAP)  /* most threads mem_init_threads makes room for */
+
 void mem_init(void);
+void mem_init_threads(int threads);
+void mem_init_region(size_t size);
 void mem_deinit(void);
 void *mem_sbrk(int incr);
 void mem_reset_brk(void);
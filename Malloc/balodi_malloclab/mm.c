@@ -1,42 +1,92 @@
 #include "mm.h"      // prototypes of functions implemented in this file
 
 #include "memlib.h"  // mem_sbrk -- to extend the heap
-#include <string.h>  // memcpy -- to copy regions of memory
+#include <stdio.h>   // printf -- to report heap problems in mm_check
+#include <string.h>  // memcpy, memset -- to copy regions of memory
+#include <stdint.h>  // uintptr_t -- to mask addresses
+#include <pthread.h> // pthread_mutex_t, pthread_key_t -- to share the heap between threads
+#include <stdatomic.h>
+#include <sched.h>   // sched_yield -- to wait for a busy arena
 
 #define MAX(x, y) ((x) > (y) ? (x) : (y))
 #define MIN(x, y) ((x) > (y) ? (y) : (x))
-#define SEGLIST_SIZE 24 //size of my segregated list array
+
+/**
+ * Free blocks are kept in segregated bins:
+ * - one bin per block size below SMALL_BIN_LIMIT, in 8-byte steps (8, 16, ...)
+ * - one bin per power of 2 from SMALL_BIN_LIMIT up, holding mixed sizes; a
+ *   crowded one is a search tree (see TreeNode), so the best fit among
+ *   thousands of them is found without walking a list
+ *
+ * A bitmap has one bit per non-empty bin, so the next bin with a big enough
+ * block is found with __builtin_ctz instead of walking empty lists.
+ *
+ * Free mini blocks are in no bin, so the 8-byte bin stays empty: no request
+ * is small enough to take one, and a mini block only has room for one link,
+ * which would make removing it from a list a walk. It goes back into use when
+ * a neighbour is freed and coalesces with it.
+ */
+#define SMALL_BIN_LIMIT 1024
+#define SMALL_BINS (SMALL_BIN_LIMIT / 8 - 1)     // exact sizes 8 .. SMALL_BIN_LIMIT-8
+#define LARGE_BINS 21                            // [2^10, 2^11) .. [2^30, 2^31)
+#define SEGLIST_SIZE (SMALL_BINS + LARGE_BINS)   //size of my segregated list array
+#define BITMAP_WORDS ((SEGLIST_SIZE + 31) / 32)
 
 /**
  * A block header uses 4 bytes for:
  * - a block size, multiple of 8 (so, the last 3 bits are always 0's)
  * - an allocated bit (stored as LSB, since the last 3 bits are needed)
+ * - a prev-allocated bit (bit 1), set if the previous block is allocated
+ * - a prev-mini bit (bit 2), set if the previous block is a mini block
  *
- * A block footer has the same format.
+ * Only free blocks have a footer, with the same format as the header: a block
+ * looks back at its neighbour only when the prev-allocated bit says it is
+ * free, so allocated blocks use those 4 bytes for payload.
+ *
+ * A mini block is 8 bytes, a header and a 4-byte payload. It is too small for
+ * a footer, so the prev-mini bit is how the next block finds its start.
  * Check Figure 9.48(a) in the textbook.
  */
 typedef int BlockHeader;
 
+#define PREV_ALLOCATED 2
+#define PREV_MINI 4
+#define MINI_BLOCK_SIZE 8
+
 static int get_size(BlockHeader *bp) { //return blockHeader size
     return (*bp) & ~7;  // discard last 3 bits
 }
 static int get_allocated(BlockHeader *bp) { //alloc status
     return (*bp) & 1;   // get last bit
 }
+static int get_prev_allocated(BlockHeader *bp) { //alloc status of the previous block on heap
+    return (*bp) & PREV_ALLOCATED;
+}
 
-static void set_header(BlockHeader *bp, int size, int allocated) { //update size and allocated status of header
-    *bp = size | allocated;
+static void set_header(BlockHeader *bp, int size, int allocated) { //update size and allocated status of header, keep prev bits
+    *bp = size | allocated | (*bp & (PREV_ALLOCATED | PREV_MINI));
 }
-static void set_footer(BlockHeader *bp, int size, int allocated) { //same for footer
-    char *footer_addr = (char *)bp + get_size(bp) - 4;
+static void set_footer(BlockHeader *bp, int size, int allocated) { //same for footer, free blocks only
+    if (size == MINI_BLOCK_SIZE)
+        return;  // the 4 bytes after the header hold the free list link
+    char *footer_addr = (char *)bp + size - 4;
     // the footer has the same format as the header
-    set_header((BlockHeader *)footer_addr, size, allocated);
+    *(BlockHeader *)footer_addr = size | allocated;
+}
+static void set_prev_status(BlockHeader *bp, BlockHeader *prev) { //record in bp's header whether prev is allocated or mini
+    *bp &= ~(PREV_ALLOCATED | PREV_MINI);
+    if (get_allocated(prev))
+        *bp |= PREV_ALLOCATED;
+    if (get_size(prev) == MINI_BLOCK_SIZE)
+        *bp |= PREV_MINI;
 }
 
 static char *get_payload_addr(BlockHeader *bp) { // payload address is header+4
     return (char *)(bp + 1);
 }
-static BlockHeader *get_prev(BlockHeader *bp) { //find header of prev block on heap
+static BlockHeader *get_prev(BlockHeader *bp) { //find header of prev block on heap, which must be free
+    if (*bp & PREV_MINI)
+        return (BlockHeader *)((char *)bp - MINI_BLOCK_SIZE);
     // move back by 4 bytes to find the footer of the previous block
     BlockHeader *previous_footer = bp - 1;
     int previous_size = get_size(previous_footer);
@@ -45,13 +95,18 @@ static BlockHeader *get_prev(BlockHeader *bp) { //find header of prev block on h
 }
 static BlockHeader *get_next(BlockHeader *bp) { //find header of next block on heap
     int this_size = get_size(bp);
-    char *next_addr = (char *)bp + this_size;  // TODO: to implement, look at get_prev
+    char *next_addr = (char *)bp + this_size;
     return (BlockHeader *)next_addr;
 }
 
+static void update_next(BlockHeader *bp) { //record bp's status in the header of the next block
+    set_prev_status(get_next(bp), bp);
+}
+
 /**
  * In addition to the block header with size/allocated bit, a free block has
  * pointers to the headers of the previous and next blocks on the free list.
+ * A free mini block has no room for them and is kept on no list.
  *
  * Pointers use 4 bytes because this project is compiled with -m32.
  * Check Figure 9.48(b) in the textbook.
@@ -62,6 +117,29 @@ typedef struct {
     BlockHeader *next_free;
 } FreeBlockHeader;
 
+/**
+ * A large bin is a treap: a binary search tree ordered by (size, address),
+ * which is also a heap ordered by a priority hashed from the address. The
+ * random priorities keep the expected depth logarithmic, so best fit, insert
+ * and remove take O(log n) steps, and the nodes need no colour or parent
+ * pointer.
+ *
+ * A treap only pays off once a bin is crowded: for a few dozen blocks,
+ * walking a list for the best fit is cheaper than hashing priorities and
+ * rebalancing on every insert and remove. A large bin is therefore a list
+ * like a small bin until it holds more than TREE_MIN_BLOCKS blocks, and turns
+ * back into a list when it is down to half of that, so a bin that hovers
+ * around the limit is not rebuilt on every free.
+ */
+typedef struct {
+    BlockHeader header;
+    BlockHeader *left;
+    BlockHeader *right;
+    unsigned int priority;
+} TreeNode;
+
+#define TREE_MIN_BLOCKS 64
+
 static BlockHeader *get_prev_free(BlockHeader *bp) { //header address of prev free block
     FreeBlockHeader *fp = (FreeBlockHeader *)bp;
     return fp->prev_free;
@@ -79,197 +157,532 @@ static void set_next_free(BlockHeader *bp, BlockHeader *next) { //set next free
     fp->next_free = next;
 }
 
+/**
+ * The heap is split into arenas, so that threads using different arenas never
+ * wait for each other. Each arena has its own bins and lock, and grows by
+ * taking segments of the memlib region:
+ * - if its last segment ends at the break, it extends that segment, just
+ *   like a single heap would
+ * - otherwise it starts a new segment of at least ARENA_SEGMENT bytes, with
+ *   its own prologue and epilogue, so blocks never merge across arenas
+ *
+ * Segments are recorded in address order, so the arena owning a block is
+ * found with a binary search. The first time a thread allocates, it picks the
+ * arena used by the fewest threads, so the arenas of exited threads are reused.
+ *
+ * A block freed by a thread of another arena is not coalesced right away: it
+ * is pushed on the remote_frees stack of its arena with a compare-and-swap,
+ * and the next malloc in that arena takes the whole stack with one exchange
+ * and frees the blocks under the arena lock.
+ */
+#define NUM_ARENAS 16
+
+/**
+ * Payloads of up to SLAB_LIMIT bytes are not blocks: they are objects in a
+ * slab, one SLAB_SIZE page holding objects of a single size, a multiple of 8.
+ * Objects have no header or footer. A slab is the payload of an allocated
+ * SLAB_SIZE block placed so that it starts on a page boundary:
+ *
+ *   | header | Slab | object | object | ... | unused | next block header |
+ *            ^ page boundary                          ^ 4 bytes before the next page
+ *
+ * so the slab of an object is found by masking its address. slab_pages has a
+ * bit for each page of the memlib region, set while the page holds a slab, to
+ * tell objects from blocks on free.
+ *
+ * Each arena keeps, per object size, a list of its slabs with free objects.
+ * A slab that becomes empty goes back to the heap, unless it is the last one
+ * of its size.
+ *
+ * An arena starts its first slab of a size only once it has SLAB_MIN_BLOCKS
+ * small blocks (of at most SMALL_BLOCK bytes) in use. Until then small
+ * payloads are blocks like any other: a page for a handful of objects costs
+ * more than it saves, and a slab placed behind a growing block keeps that
+ * block from growing in place.
+ */
+#define SLAB_SHIFT 12
+#define SLAB_SIZE (1 << SLAB_SHIFT)
+#define SLAB_LIMIT 128
+#define SLAB_CLASSES (SLAB_LIMIT / 8)        // object sizes 8 .. SLAB_LIMIT
+#define SLAB_PAGES (MAX_REGION / SLAB_SIZE + 1) // the region need not start on a page boundary
+#define SLAB_MIN_BLOCKS 32
+#define SMALL_BLOCK (SLAB_LIMIT + 8)         // the block of a SLAB_LIMIT-byte payload
+
+struct Arena;
+
+typedef struct Slab {
+    struct Slab *prev;                      // neighbours on the list of its size
+    struct Slab *next;
+    struct Arena *arena;
+    char *free;                             // freed objects, linked through their first word
+    char *unused;                           // objects from here on were never handed out
+    int size;                               // object size
+    int used;                               // objects handed out
+} Slab;
+
+#define SLAB_OBJECTS ((int)((sizeof(Slab) + 7) / 8 * 8))  // offset of the first object
+#define SLAB_END (SLAB_SIZE - 4)                           // the next block header follows
+#define ARENA_SEGMENT (64 * 1024)
+#define MAX_SEGMENTS (MAX_REGION / ARENA_SEGMENT)  // the largest memlib region
+
+/**
+ * An arena lock is held for a few hundred cycles at a time, so it is a spin
+ * lock: taking it costs one exchange and releasing it a store, where a mutex
+ * costs an atomic operation for each. A thread that finds it taken yields,
+ * as the holder may be waiting for the CPU.
+ */
+typedef atomic_int SpinLock;
+
+static void spin_lock(SpinLock *lock) {
+    while (atomic_exchange_explicit(lock, 1, memory_order_acquire)) {
+        while (atomic_load_explicit(lock, memory_order_relaxed))
+            sched_yield();
+    }
+}
+static void spin_unlock(SpinLock *lock) {
+    atomic_store_explicit(lock, 0, memory_order_release);
+}
+
+typedef struct Arena {
+    SpinLock lock;
+    /* Pointer to segregated free list, or to the root of a large bin's treap */
+    BlockHeader *seg_free_list[SEGLIST_SIZE];
+    /* Bit i of the bitmap is set iff seg_free_list[i] is not empty */
+    unsigned int seg_bitmap[BITMAP_WORDS];
+    int large_blocks[LARGE_BINS];           // free blocks in each large bin
+    unsigned int tree_bins;                 // bit i is set iff large bin i is a treap
+    BlockHeader *epilogue;                  // of the last segment, NULL before the first one
+    _Atomic(char *) remote_frees;           // payloads freed by threads of other arenas
+    atomic_int threads;                     // running threads that use this arena
+    Slab *slabs[SLAB_CLASSES];              // slabs with free objects, per object size
+    unsigned int slab_classes;              // bit cls is set once a slab of size (cls+1)*8 was started
+    int small_blocks;                       // allocated blocks of at most SMALL_BLOCK bytes
+} Arena;
+
+typedef struct {
+    char *start;
+    Arena *arena;
+} Segment;
+
 /* Pointer to the header of the first block on the heap */
 static BlockHeader *heap_blocks;
-/* Pointers to the headers of the first and last blocks on the free list */
-static BlockHeader *free_headp;
-static BlockHeader *free_tailp;
-/* Pointer to segregated free list */
-BlockHeader *seg_free_list[SEGLIST_SIZE];
-
-static void free_list_insert(BlockHeader *bp){ //insert freed block into segregate free list
-    int list_count = 0;
-    BlockHeader *search_ptr = NULL;
-    BlockHeader *insert_ptr = NULL;
-    int size = get_size(bp);
-    int tempsize = size;
-    //identify appropriate segregated list
-    while( (list_count<(SEGLIST_SIZE-1)) && (tempsize>1) ){
-        tempsize >>= 1;
-        list_count++;
-    }
-
-    //segregated list points to the most recently put term and then you traverse backwards
-    search_ptr = seg_free_list[list_count];
-    while ((search_ptr != NULL) && (size > get_size(search_ptr)) ) { //sort the pointer by size in segregated list
-        insert_ptr = search_ptr;
-        search_ptr = get_next_free(search_ptr);
-    }
-
-    // Set predecessor and successor 
-    if (search_ptr != NULL) {                   // storage position in the middle of the list
-        if (insert_ptr != NULL) {
-            set_next_free(bp, search_ptr);
-            set_prev_free(search_ptr, bp);
-            set_prev_free(bp, insert_ptr);
-            set_next_free(insert_ptr, bp);
-        } else {                                // append to the beginning of the list (list not empty)
-            set_next_free(bp, search_ptr);
-            set_prev_free(search_ptr, bp);
-            set_prev_free(bp, NULL);
-            seg_free_list[list_count] = bp;
-        }
-    } else {                                    // storage position at the end of the list
-        if (insert_ptr != NULL) {
-            set_next_free(bp, NULL);
-            set_prev_free(bp, insert_ptr);
-            set_next_free(insert_ptr, bp);
-        } else {                                // list is empty
-            set_prev_free(bp, NULL);
-            set_next_free(bp, NULL);
-            seg_free_list[list_count] = bp;
-        }
+
+static Arena arenas[NUM_ARENAS];
+static _Thread_local Arena *thread_arena;
+
+/* Segments in address order; an entry never changes once it is counted */
+static Segment segments[MAX_SEGMENTS];
+static atomic_int num_segments;
+/* Held while an arena grows, so the break does not move between the check and mem_sbrk */
+static pthread_mutex_t grow_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Bit i is set iff page i of the memlib region holds a slab */
+static atomic_uint slab_pages[(SLAB_PAGES + 31) / 32];
+static uintptr_t heap_first_page;           // page number of mem_heap_lo()
+
+/**
+ * In front of the arenas, every thread keeps a cache of small free objects
+ * (tcache), one list per slab object size, so most small mallocs and frees take
+ * no lock at all:
+ * - malloc pops an object of the exact size from the cache; if the list is
+ *   empty, it first takes TCACHE_BATCH objects from its arena under one lock
+ * - free pushes the object on the cache; if the list is full, it first gives
+ *   TCACHE_BATCH objects back to their arenas under one lock
+ *
+ * A cached object is still in use as far as its slab is concerned; the list
+ * link lives in its first word, as for payloads waiting on a remote_frees
+ * stack.
+ *
+ * mm_init throws the whole heap away, so it bumps heap_generation and every
+ * thread drops its cache the next time it looks at it.
+ */
+#define TCACHE_CLASSES SLAB_CLASSES  // object sizes 8 .. SLAB_LIMIT
+#define TCACHE_MAX 16       // cached objects per size
+#define TCACHE_BATCH 8      // objects moved between a cache and the arenas at once
+
+typedef struct {
+    unsigned int generation;              // heap_generation the objects came from
+    int registered;                       // tcache_key points to this cache
+    int count[TCACHE_CLASSES];
+    char *head[TCACHE_CLASSES];
+} ThreadCache;
+
+static atomic_uint heap_generation;
+static _Thread_local ThreadCache tcache;
+/* Flushes the cache of a thread and releases its arena when it exits */
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+
+static int bin_index(int size) { //bin of a free block of size bytes
+    if (size < SMALL_BIN_LIMIT)
+        return size / 8 - 1;
+    return SMALL_BINS + (31 - __builtin_clz(size)) - 10;  // floor(log2(size)) - 10
+}
+
+static int next_nonempty_bin(Arena *arena, int bin) { //first non-empty bin >= bin, or -1
+    for (int word = bin / 32; word < BITMAP_WORDS; word++) {
+        unsigned int bits = arena->seg_bitmap[word];
+        if (word == bin / 32)
+            bits &= ~0U << (bin % 32);  // skip the bins before `bin`
+        if (bits)
+            return word * 32 + __builtin_ctz(bits);
     }
+    return -1;
 }
-static void free_list_remove(BlockHeader *bp) { //remove a block from free list
-    // TODO: implement
-    if(get_allocated(bp)){
-        return;
+
+static BlockHeader **tree_left(BlockHeader *bp) {
+    return &((TreeNode *)bp)->left;
+}
+static BlockHeader **tree_right(BlockHeader *bp) {
+    return &((TreeNode *)bp)->right;
+}
+static int tree_less(BlockHeader *a, BlockHeader *b) { //order of the treap: by size, then by address
+    return get_size(a) < get_size(b) || (get_size(a) == get_size(b) && a < b);
+}
+static unsigned int tree_priority(BlockHeader *bp) {
+    return ((TreeNode *)bp)->priority;
+}
+static void set_tree_priority(BlockHeader *bp) { //mix the address bits, as neighbouring blocks must get unrelated priorities
+    unsigned int x = (unsigned int)(uintptr_t)bp;
+    x ^= x >> 16;
+    x *= 0x7feb352dU;
+    x ^= x >> 15;
+    x *= 0x846ca68bU;
+    x ^= x >> 16;
+    ((TreeNode *)bp)->priority = x;
+}
+
+/* Insert bp in the treap at *root, above the first node it outranks on its search path */
+static void tree_insert(BlockHeader **root, BlockHeader *bp) {
+    set_tree_priority(bp);
+
+    // descend while the nodes outrank bp
+    BlockHeader **link = root;
+    while (*link != NULL && tree_priority(*link) > tree_priority(bp))
+        link = tree_less(bp, *link) ? tree_left(*link) : tree_right(*link);
+
+    // bp takes this place: split the subtree there into the nodes before and after bp
+    BlockHeader *node = *link;
+    BlockHeader **left = tree_left(bp);
+    BlockHeader **right = tree_right(bp);
+    *link = bp;
+    while (node != NULL) {
+        if (tree_less(node, bp)) {
+            *left = node;                 // with its left subtree, before bp
+            left = tree_right(node);
+            node = *left;
+        } else {
+            *right = node;                // with its right subtree, after bp
+            right = tree_left(node);
+            node = *right;
+        }
     }
+    *left = NULL;
+    *right = NULL;
+}
 
-    int list_count = 0;
-    int size = get_size(bp);
+/* Remove bp from the treap at *root */
+static void tree_remove(BlockHeader **root, BlockHeader *bp) {
+    BlockHeader **link = root;
+    while (*link != bp)
+        link = tree_less(bp, *link) ? tree_left(*link) : tree_right(*link);
 
-    //identify appropriate segregated list
-    while( (list_count<(SEGLIST_SIZE-1)) && (size>1) ){
-        size = size >> 1;
-        list_count++;
+    // merge the subtrees of bp in its place, the higher priority on top
+    BlockHeader *left = *tree_left(bp);
+    BlockHeader *right = *tree_right(bp);
+    while (left != NULL && right != NULL) {
+        if (tree_priority(left) > tree_priority(right)) {
+            *link = left;
+            link = tree_right(left);
+            left = *link;
+        } else {
+            *link = right;
+            link = tree_left(right);
+            right = *link;
+        }
     }
+    *link = left != NULL ? left : right;
+}
 
-    if (get_next_free(bp) != NULL) {                                // if bp has a successor term
-        if (get_prev_free(bp) != NULL) {                            // check if bp is not the first term in seg list
-            set_prev_free(get_next_free(bp), get_prev_free(bp));
-            set_next_free(get_prev_free(bp), get_next_free(bp));
-        } else {                                                    // bp is the first term and has successor
-            set_prev_free(get_next_free(bp), NULL);
-            seg_free_list[list_count] = get_next_free(bp);
+static BlockHeader *tree_best_fit(BlockHeader *root, int size) { //smallest block of a treap with at least size bytes, lowest address first
+    BlockHeader *best = NULL;
+    BlockHeader *node = root;
+    while (node != NULL) {
+        if (get_size(node) >= size) {
+            best = node;
+            node = *tree_left(node);
+        } else {
+            node = *tree_right(node);
         }
-    } else {                                                        // bp doesn't have successor
-        if (get_prev_free(bp) != NULL) {                                    // bp has predecessor
-            set_next_free(get_prev_free(bp), NULL);
-        } else {                                                    // bp has no predecessor (i.e. only 1 term in seg list)
-            seg_free_list[list_count] = NULL;
+    }
+    return best;
+}
+
+static int is_tree_bin(Arena *arena, int bin) {
+    return bin >= SMALL_BINS && ((arena->tree_bins >> (bin - SMALL_BINS)) & 1);
+}
+static void bin_to_tree(Arena *arena, int bin) { //rebuild the list of a large bin as a treap
+    BlockHeader *ptr = arena->seg_free_list[bin];
+    arena->seg_free_list[bin] = NULL;
+    while (ptr != NULL) {
+        BlockHeader *next = get_next_free(ptr);     // the tree links overwrite the list links
+        tree_insert(&arena->seg_free_list[bin], ptr);
+        ptr = next;
+    }
+    arena->tree_bins |= 1U << (bin - SMALL_BINS);
+}
+static void bin_to_list(Arena *arena, int bin) { //rebuild the treap of a large bin as a list
+    BlockHeader **root = &arena->seg_free_list[bin];
+    BlockHeader *head = NULL;
+    while (*root != NULL) {
+        BlockHeader *bp = *root;
+        tree_remove(root, bp);
+        set_prev_free(bp, NULL);
+        set_next_free(bp, head);
+        if (head != NULL)
+            set_prev_free(head, bp);
+        head = bp;
+    }
+    *root = head;
+    arena->tree_bins &= ~(1U << (bin - SMALL_BINS));
+}
+
+static void free_list_insert(Arena *arena, BlockHeader *bp){ //insert freed block at the head of its bin, or in its treap
+    int bin = bin_index(get_size(bp));
+    if (bin == 0)                                   // mini blocks are not binned
+        return;
+    if (bin >= SMALL_BINS) {
+        int count = ++arena->large_blocks[bin - SMALL_BINS];
+        if (count > TREE_MIN_BLOCKS && !is_tree_bin(arena, bin))
+            bin_to_tree(arena, bin);
+        if (is_tree_bin(arena, bin)) {              // never empty, so its bitmap bit is set
+            tree_insert(&arena->seg_free_list[bin], bp);
+            return;
         }
     }
+    BlockHeader *head = arena->seg_free_list[bin];
+    set_prev_free(bp, NULL);
+    set_next_free(bp, head);
+    if (head != NULL)
+        set_prev_free(head, bp);
+    else
+        arena->seg_bitmap[bin / 32] |= 1U << (bin % 32);
+    arena->seg_free_list[bin] = bp;
 }
-static BlockHeader *free_coalesce(BlockHeader *bp) { // mark a block as free, coalesce with contiguous free block on heap, add coalesced block to free list
+static void free_list_remove(Arena *arena, BlockHeader *bp) { //remove a block from free list
+    if(get_allocated(bp)){
+        return;
+    }
 
-    // mark block as free
-    int size = get_size(bp);
-    set_header(bp, size, 0);
-    set_footer(bp, size, 0);
+    if (get_size(bp) >= SMALL_BIN_LIMIT) {
+        int bin = bin_index(get_size(bp));
+        int count = --arena->large_blocks[bin - SMALL_BINS];
+        if (is_tree_bin(arena, bin)) {              // left with at least TREE_MIN_BLOCKS / 2 blocks
+            tree_remove(&arena->seg_free_list[bin], bp);
+            if (count <= TREE_MIN_BLOCKS / 2)
+                bin_to_list(arena, bin);
+            return;
+        }
+    }
+    if (get_size(bp) == MINI_BLOCK_SIZE)            // mini blocks are not binned
+        return;
+
+    BlockHeader *prev = get_prev_free(bp);
+    BlockHeader *next = get_next_free(bp);
+    if (next != NULL)
+        set_prev_free(next, prev);
+    if (prev != NULL) {
+        set_next_free(prev, next);
+    } else {                                        // bp is the first block of its bin
+        int bin = bin_index(get_size(bp));
+        arena->seg_free_list[bin] = next;
+        if (next == NULL)
+            arena->seg_bitmap[bin / 32] &= ~(1U << (bin % 32));
+    }
+}
+static BlockHeader *free_coalesce(Arena *arena, BlockHeader *bp) { // mark a block as free, coalesce with contiguous free block on heap, add coalesced block to free list
 
     // check whether contiguous blocks are allocated
-    int prev_alloc = get_allocated(get_prev(bp));
+    int size = get_size(bp);
+    int prev_alloc = get_prev_allocated(bp);
     int next_alloc = get_allocated(get_next(bp));
 
     if (prev_alloc && next_alloc) {                     //prev and next blocks allocated
-        // TODO: add bp to free list
-        return bp;
-
+        // nothing to merge
     } else if (prev_alloc && !next_alloc) {             //prev allocated, next free
-        // TODO: remove next block from free list
-        // TODO: add bp to free list        note: for a segregated free list, once size changes the free list may change
-        // TODO: coalesce with next block         so insertion happens after coalescing
-        free_list_remove(bp);
-        free_list_remove(get_next(bp));
+        // note: for a segregated free list, once size changes the free list may change
+        // so insertion happens after coalescing
+        free_list_remove(arena, get_next(bp));
         size += get_size(get_next(bp));
-        set_header(bp, size, 0);
-        set_footer(bp, size, 0);
-        free_list_insert(bp);
-        return bp;
 
     } else if (!prev_alloc && next_alloc) {             //prev free, next allocated
-        // TODO: coalesce with previous block
-        free_list_remove(bp);
-        free_list_remove(get_prev(bp));
-        size += get_size(get_prev(bp));
-        set_header(get_prev(bp), size, 0);
-        set_footer(bp, size, 0);
-        free_list_insert(get_prev(bp));
-        return get_prev(bp);
+        bp = get_prev(bp);
+        free_list_remove(arena, bp);
+        size += get_size(bp);
 
     } else {                                            //prev and next blocks free
-        // TODO: remove next block from free list
-        // TODO: coalesce with previous and next block
-        free_list_remove(bp);
-        free_list_remove(get_prev(bp));
-        free_list_remove(get_next(bp));
-        size = size + get_size(get_prev(bp)) + get_size(get_next(bp));
-        set_header(get_prev(bp), size, 0);
-        set_footer(get_next(bp), size, 0);
-        free_list_insert(get_prev(bp));
-        return get_prev(bp);
+        free_list_remove(arena, get_next(bp));
+        size += get_size(get_next(bp));
+        bp = get_prev(bp);
+        free_list_remove(arena, bp);
+        size += get_size(bp);
     }
+
+    // mark the merged block as free and tell the block after it
+    set_header(bp, size, 0);
+    set_footer(bp, size, 0);
+    update_next(bp);
+    free_list_insert(arena, bp);
+    return bp;
+}
+
+/**
+ * Start a new segment for `arena` at the break, with grow_lock held: an
+ * 8-byte prologue and an epilogue, which extend_heap then grows.
+ *
+ * @return 0 on success, -1 if memlib or the segment table is full
+ */
+static int new_segment(Arena *arena) {
+    int count = atomic_load_explicit(&num_segments, memory_order_relaxed);
+    if (count == MAX_SEGMENTS)
+        return -1;
+
+    // create empty segment of 4 x 4-byte words
+    char *new_region = mem_sbrk(16);
+    if ((long)new_region == -1)
+        return -1;
+
+    BlockHeader *prologue = (BlockHeader *)new_region;
+    prologue[0] = 0;                        // skip 4 bytes for alignment
+    prologue[1] = 8 | 1 | PREV_ALLOCATED;   // allocate a block of 8 bytes as prologue
+    prologue[3] = 0;
+    set_header(prologue + 3, 0, 1);         // epilogue
+    prologue += 1;                          // point to the prologue header
+    update_next(prologue);
+    arena->epilogue = prologue + 2;
+
+    if (count == 0)
+        heap_blocks = prologue;
+    segments[count].start = new_region;
+    segments[count].arena = arena;
+    atomic_store_explicit(&num_segments, count + 1, memory_order_release);
+    return 0;
 }
 
-static BlockHeader *extend_heap(int size) { //extend heap with a free block of size bytes (multiple of 8)
+static BlockHeader *extend_heap(Arena *arena, int size) { //extend an arena with a free block of size bytes (multiple of 8), with its lock held
+
+    pthread_mutex_lock(&grow_lock);
+    if (arena->epilogue == NULL || (char *)(arena->epilogue + 1) != (char *)mem_heap_hi() + 1) {
+        // another arena grew last: the first segment fits the request, later
+        // ones are large enough that the segment table stays short
+        if (atomic_load_explicit(&num_segments, memory_order_relaxed) > 0)
+            size = MAX(size, ARENA_SEGMENT);
+        if (new_segment(arena) < 0) {
+            pthread_mutex_unlock(&grow_lock);
+            return NULL;
+        }
+    }
 
     // bp points to the beginning of the new block
     char *bp = mem_sbrk(size);
+    pthread_mutex_unlock(&grow_lock);
     if ((long)bp == -1)
         return NULL;
 
-    // write header over old epilogue, then the footer
+    // write header over old epilogue, which knows the status of the last block
     BlockHeader *old_epilogue = (BlockHeader *)bp - 1;
-    set_header(old_epilogue, size, 0);
-    set_footer(old_epilogue, size, 0);
-    free_list_insert(old_epilogue);
+    set_header(old_epilogue, size, 1);
 
     // write new epilogue
-    set_header(get_next(old_epilogue), 0, 1);
+    arena->epilogue = get_next(old_epilogue);
+    set_header(arena->epilogue, 0, 1);
 
-    // merge new block with previous one if possible
-    return free_coalesce(old_epilogue);
+    // free the new block, merging it with the previous one if possible
+    return free_coalesce(arena, old_epilogue);
 }
-int mm_init(void) { //initialize malloc package called prior to malloc, realloc or free, used for initialization e.g. initial heap area
 
-    // init list of free blocks
-    free_headp = NULL;
-    free_tailp = NULL;
+static void register_thread(void);
 
-    // Initialize segregated free list array
-    for (int list = 0; list < SEGLIST_SIZE; list++) {
-        seg_free_list[list] = NULL;
+static Arena *get_arena(void) { //arena of the calling thread
+    if (thread_arena == NULL) {
+        Arena *best = &arenas[0];
+        for (int i = 1; i < NUM_ARENAS; i++) {
+            if (atomic_load(&arenas[i].threads) < atomic_load(&best->threads))
+                best = &arenas[i];
+        }
+        atomic_fetch_add(&best->threads, 1);
+        thread_arena = best;
+        register_thread();
     }
+    return thread_arena;
+}
 
-    // Allocate memory for the initial empty heap
-    // create empty heap of 4 x 4-byte words
-    char *new_region = mem_sbrk(16);
-    if ((long)new_region == -1)
-        return -1;
+static Arena *arena_of(BlockHeader *bp) { //arena owning a block: the one of the last segment starting before it
+    int lo = 0;
+    int hi = atomic_load_explicit(&num_segments, memory_order_acquire) - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (segments[mid].start <= (char *)bp)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return segments[lo].arena;
+}
 
-    heap_blocks = (BlockHeader *)new_region;
-    set_header(heap_blocks, 0, 0);      // skip 4 bytes for alignment
-    set_header(heap_blocks + 1, 8, 1);  // allocate a block of 8 bytes as prologue
-    set_footer(heap_blocks + 1, 8, 1);
-    set_header(heap_blocks + 3, 0, 1);  // epilogue
-    heap_blocks += 1;                   // point to the prologue header
+int mm_init(void) { //initialize malloc package called prior to malloc, realloc or free, used for initialization e.g. initial heap area
+    // no other thread may use the allocator while it is reset
+    atomic_fetch_add(&heap_generation, 1);  // blocks cached by any thread are gone
+
+    // Initialize segregated free list arrays
+    for (int i = 0; i < NUM_ARENAS; i++) {
+        Arena *arena = &arenas[i];
+        for (int list = 0; list < SEGLIST_SIZE; list++) {
+            arena->seg_free_list[list] = NULL;
+        }
+        for (int word = 0; word < BITMAP_WORDS; word++) {
+            arena->seg_bitmap[word] = 0;
+        }
+        for (int bin = 0; bin < LARGE_BINS; bin++) {
+            arena->large_blocks[bin] = 0;
+        }
+        arena->tree_bins = 0;
+        for (int cls = 0; cls < SLAB_CLASSES; cls++) {
+            arena->slabs[cls] = NULL;
+        }
+        arena->slab_classes = 0;
+        arena->small_blocks = 0;
+        arena->epilogue = NULL;
+        atomic_store(&arena->remote_frees, NULL);
+    }
+    atomic_store(&num_segments, 0);
+    memset(slab_pages, 0, sizeof(slab_pages));
+    heap_first_page = (uintptr_t)mem_heap_lo() >> SLAB_SHIFT;
 
-    // TODO: extend heap with an initial heap size
-    if (extend_heap(64) == NULL){ 
+    // start the heap with a small free block in the arena of this thread
+    Arena *arena = get_arena();
+    spin_lock(&arena->lock);
+    BlockHeader *first = extend_heap(arena, 64);
+    spin_unlock(&arena->lock);
+    if (first == NULL){ 
         return -1; }
 
     return 0;
 }
-void mm_free(void *bp) {
-    // TODO: move back 4 bytes to find the block header, then free block
-    BlockHeader *ptr = (BlockHeader *)bp - 1;
-    int size = get_size(ptr);
-    set_header(ptr, size, 0);
-    set_footer(ptr, size, 0);
-    free_list_insert(ptr);
-    free_coalesce(ptr);
+
+static BlockHeader *bin_best_fit(Arena *arena, int bin, int size) { //smallest block of a large bin that fits
+    if (is_tree_bin(arena, bin))
+        return tree_best_fit(arena->seg_free_list[bin], size);
+    BlockHeader *best = NULL;
+    for (BlockHeader *ptr = arena->seg_free_list[bin]; ptr != NULL; ptr = get_next_free(ptr)) {
+        int ptr_size = get_size(ptr);
+        if (ptr_size >= size && (best == NULL || ptr_size < get_size(best))) {
+            best = ptr;
+            if (ptr_size == size)
+                break;
+        }
+    }
+    return best;
 }
 
 /**
@@ -279,24 +692,24 @@ void mm_free(void *bp) {
  * @return pointer to the header of a free block or `NULL` if free blocks are
  *         all smaller than `size`.
  */
-static BlockHeader *find_fit(int size) {
-    // TODO: implement
-    BlockHeader *ptr = NULL;
-    int searchsize = size;
-    for(int i=0; i<SEGLIST_SIZE; i++){
-        if( ( (searchsize <= 1) && (seg_free_list[i] != NULL) ) || (i == SEGLIST_SIZE-1) ){
-            ptr = seg_free_list[i];
-            while( (ptr!=NULL) && (size> get_size(ptr)) ){
-                ptr = get_next_free(ptr);
-            }
-            if(ptr != NULL){
-                break;
-            }
-        }
-        searchsize >>= 1;
+static BlockHeader *find_fit(Arena *arena, int size) {
+    int bin = bin_index(size);
+    if (bin >= SMALL_BINS) {
+        // a large bin mixes sizes, so only some of its blocks may fit
+        BlockHeader *ptr = bin_best_fit(arena, bin, size);
+        if (ptr != NULL)
+            return ptr;
+        bin++;
     }
-    return ptr;
+    // every block of `bin` (an exact small bin) or a later bin is big enough
+    bin = next_nonempty_bin(arena, bin);
+    if (bin < 0)
+        return NULL;
+    return bin < SMALL_BINS ? arena->seg_free_list[bin] : bin_best_fit(arena, bin, size);
 }
+/* Smallest remainder that place() splits off as a free block */
+#define MIN_SPLIT 8
+
 /**
  * Allocate a block of `size` bytes inside the given free block `bp`.
  *
@@ -304,73 +717,448 @@ static BlockHeader *find_fit(int size) {
  * @param size bytes to assign as an allocated block (multiple of 8)
  * @return pointer to the header of the allocated block
  */
-static BlockHeader *place(BlockHeader *bp, int size) {
-    // TODO: if current size is greater, use part and add rest to free list
+static BlockHeader *place(Arena *arena, BlockHeader *bp, int size) {
     int bp_size = get_size(bp);
     int remainder = bp_size - size;
     
-    free_list_remove(bp);
+    free_list_remove(arena, bp);
 
-    if(remainder <= 16){ // 16 is the min block size, but we can adjust this count
+    if(remainder < MIN_SPLIT){ // too small to be worth a free block of its own
         set_header(bp,bp_size,1);
-        set_footer(bp,bp_size,1);
+        update_next(bp);
     } else { 
         if(remainder >= 100){
             set_header(bp,remainder,0);
             set_footer(bp,remainder,0);
-            set_header(get_next(bp),size,1);
-            set_footer(get_next(bp),size,1);
-            free_list_insert(bp);
-            return get_next(bp);
+            BlockHeader *alloc = get_next(bp);
+            set_header(alloc,size,1);
+            set_prev_status(alloc,bp);
+            update_next(alloc);
+            free_list_insert(arena, bp);
+            return alloc;
         }
         else{
             set_header(bp,size,1);
-            set_footer(bp,size,1);
-            set_header(get_next(bp),remainder,0);
-            set_footer(get_next(bp),remainder,0);
-            free_list_insert(get_next(bp));
+            BlockHeader *rest = get_next(bp);
+            set_header(rest,remainder,0);
+            set_footer(rest,remainder,0);
+            set_prev_status(rest,bp);
+            update_next(rest);
+            free_list_insert(arena, rest);
         }
     }
-    // TODO: return pointer to header of allocated block
     return bp;
 }
 
 /**
- * Compute the required block size (including space for header/footer) from the
- * requested payload size.
+ * Shrink the allocated block `bp` to `size` bytes and free the rest, merging
+ * it with the next block if that one is free.
+ */
+static void shrink_block(Arena *arena, BlockHeader *bp, int size) {
+    int rest_size = get_size(bp) - size;
+    set_header(bp, size, 1);
+    BlockHeader *rest = get_next(bp);
+    set_header(rest, rest_size, 1);
+    set_prev_status(rest, bp);
+    free_coalesce(arena, rest);
+}
+
+/**
+ * Compute the required block size (including space for the header) from the
+ * requested payload size. Allocated blocks have no footer, so payloads of up
+ * to 4 bytes fit a mini block.
  *
  * @param payload_size requested payload size
- * @return a block size including header/footer that is a multiple of 8
+ * @return a block size including header that is a multiple of 8
  */
 static int required_block_size(int payload_size) {
-    payload_size += 8;                    // add 8 for for header/footer
+    payload_size += 4;                    // add 4 for the header
     return ((payload_size + 7) / 8) * 8;  // round up to multiple of 8
 }
 
-void *mm_malloc(size_t size) {
-    // ignore spurious requests
-    if (size == 0)
+static char *get_link(char *p) { //next payload on a cache list, slab free list or remote-free stack
+    return *(char **)p;
+}
+static void set_link(char *p, char *next) {
+    *(char **)p = next;
+}
+
+static atomic_uint *slab_page_word(char *p, unsigned int *bit) { //word and bit of slab_pages for the page of p
+    uintptr_t page = ((uintptr_t)p >> SLAB_SHIFT) - heap_first_page;
+    *bit = 1U << (page % 32);
+    return &slab_pages[page / 32];
+}
+static Slab *slab_of(char *p) { //slab holding the object p, or NULL if p is the payload of a block
+    unsigned int bit;
+    atomic_uint *word = slab_page_word(p, &bit);
+    if (!(atomic_load_explicit(word, memory_order_relaxed) & bit))
         return NULL;
+    return (Slab *)((uintptr_t)p & ~(uintptr_t)(SLAB_SIZE - 1));
+}
+static int slab_class(int size) { //slab list of objects of size bytes, or -1 for a block
+    return size <= SLAB_LIMIT ? (size + 7) / 8 - 1 : -1;
+}
+static int slab_full(Slab *slab) {
+    return slab->free == NULL && slab->unused + slab->size > (char *)slab + SLAB_END;
+}
 
-    int asize = 0;
-    if (size <= 8){
-        asize = 16;
-    } else{
-        asize = required_block_size(size);
+static void slab_list_insert(Arena *arena, int cls, Slab *slab) {
+    slab->prev = NULL;
+    slab->next = arena->slabs[cls];
+    if (slab->next != NULL)
+        slab->next->prev = slab;
+    arena->slabs[cls] = slab;
+}
+static void slab_list_remove(Arena *arena, int cls, Slab *slab) {
+    if (slab->next != NULL)
+        slab->next->prev = slab->prev;
+    if (slab->prev != NULL)
+        slab->prev->next = slab->next;
+    else
+        arena->slabs[cls] = slab->next;
+}
+
+/**
+ * Allocate a SLAB_SIZE block whose payload starts on a page boundary, with
+ * the arena lock held. The free space before and after it stays free.
+ *
+ * @return the payload (the page) or `NULL` if the heap cannot grow
+ */
+static char *alloc_page(Arena *arena) {
+    // wherever the free block starts, a page boundary follows within SLAB_SIZE bytes
+    int need = 2 * SLAB_SIZE;
+    BlockHeader *bp = find_fit(arena, need);
+    if (bp == NULL && (bp = extend_heap(arena, need)) == NULL)
+        return NULL;
+    free_list_remove(arena, bp);
+
+    int size = get_size(bp);
+    char *page = (char *)(((uintptr_t)bp + 4 + SLAB_SIZE - 1) & ~(uintptr_t)(SLAB_SIZE - 1));
+    BlockHeader *alloc = (BlockHeader *)page - 1;
+    int lead = (char *)alloc - (char *)bp;   // a multiple of 8, as both headers precede aligned payloads
+    int rest = size - lead - SLAB_SIZE;
+
+    if (lead > 0) {                           // free block before the page
+        set_header(bp, lead, 0);
+        set_footer(bp, lead, 0);
+        free_list_insert(arena, bp);
+    }
+    set_header(alloc, SLAB_SIZE, 1);
+    if (lead > 0)
+        set_prev_status(alloc, bp);
+    if (rest > 0) {                           // free block after the page
+        BlockHeader *tail = get_next(alloc);
+        set_header(tail, rest, 0);
+        set_footer(tail, rest, 0);
+        set_prev_status(tail, alloc);
+        update_next(tail);
+        free_list_insert(arena, tail);
+    } else {
+        update_next(alloc);
+    }
+    return page;
+}
+
+static Slab *slab_new(Arena *arena, int cls) { //start an empty slab for objects of size (cls+1)*8, with the arena lock held
+    char *page = alloc_page(arena);
+    if (page == NULL)
+        return NULL;
+    Slab *slab = (Slab *)page;
+    slab->arena = arena;
+    slab->free = NULL;
+    slab->unused = page + SLAB_OBJECTS;
+    slab->size = (cls + 1) * 8;
+    slab->used = 0;
+    unsigned int bit;
+    atomic_uint *word = slab_page_word(page, &bit);
+    atomic_fetch_or_explicit(word, bit, memory_order_relaxed);
+    slab_list_insert(arena, cls, slab);
+    arena->slab_classes |= 1U << cls;
+    return slab;
+}
+
+/**
+ * Take an object of size (cls+1)*8 from the slabs of `arena`, with its lock
+ * held.
+ *
+ * @return the object, or `NULL` if the arena has too few small blocks in use
+ *         for a first slab of this size or the heap cannot grow
+ */
+static char *slab_alloc(Arena *arena, int cls) {
+    Slab *slab = arena->slabs[cls];
+    if (slab == NULL) {
+        if (!(arena->slab_classes & (1U << cls)) && arena->small_blocks < SLAB_MIN_BLOCKS)
+            return NULL;
+        if ((slab = slab_new(arena, cls)) == NULL)
+            return NULL;
+    }
+
+    char *obj = slab->free;
+    if (obj != NULL) {
+        slab->free = get_link(obj);
+    } else {
+        obj = slab->unused;
+        slab->unused += slab->size;
+    }
+    slab->used++;
+    if (slab_full(slab))
+        slab_list_remove(arena, cls, slab);
+    return obj;
+}
+
+/* Give an object back to its slab, which belongs to `arena`, with its lock held */
+static void slab_free(Arena *arena, Slab *slab, char *obj) {
+    int cls = slab_class(slab->size);
+    if (slab_full(slab))
+        slab_list_insert(arena, cls, slab);
+    set_link(obj, slab->free);
+    slab->free = obj;
+    slab->used--;
+
+    if (slab->used == 0 && (slab->prev != NULL || slab->next != NULL)) {
+        // empty and not the last slab of its size: give the page back
+        slab_list_remove(arena, cls, slab);
+        unsigned int bit;
+        atomic_uint *word = slab_page_word((char *)slab, &bit);
+        atomic_fetch_and_explicit(word, ~bit, memory_order_relaxed);
+        free_coalesce(arena, (BlockHeader *)slab - 1);
+    }
+}
+
+/* Free a payload of `arena`, object or block, with its lock held */
+static void arena_free(Arena *arena, char *p) {
+    Slab *slab = slab_of(p);
+    if (slab != NULL) {
+        slab_free(arena, slab, p);
+        return;
+    }
+    BlockHeader *bp = (BlockHeader *)p - 1;
+    if (get_size(bp) <= SMALL_BLOCK)
+        arena->small_blocks--;
+    free_coalesce(arena, bp);
+}
+
+static Arena *owner_of(char *p) { //arena of a payload, object or block
+    Slab *slab = slab_of(p);
+    return slab != NULL ? slab->arena : arena_of((BlockHeader *)p - 1);
+}
+
+/* Push a payload freed by a thread of another arena on the stack of its owner */
+static void remote_free(Arena *owner, char *p) {
+    char *head = atomic_load_explicit(&owner->remote_frees, memory_order_relaxed);
+    do {
+        set_link(p, head);
+    } while (!atomic_compare_exchange_weak_explicit(&owner->remote_frees, &head, p,
+                memory_order_release, memory_order_relaxed));
+}
+
+/* Free the payloads that other threads gave back to `arena`, with its lock held */
+static void drain_remote_frees(Arena *arena) {
+    if (atomic_load_explicit(&arena->remote_frees, memory_order_relaxed) == NULL)
+        return;
+    // the only consumer takes the whole stack, so pushes never see a reused head
+    char *p = atomic_exchange_explicit(&arena->remote_frees, NULL, memory_order_acquire);
+    while (p != NULL) {
+        char *next = get_link(p);
+        arena_free(arena, p);
+        p = next;
     }
+}
+
+/* Free a payload of any arena, with the lock of `arena` (the caller's) held */
+static void free_payload(Arena *arena, char *p) {
+    Arena *owner = owner_of(p);
+    if (owner == arena)
+        arena_free(arena, p);
+    else
+        remote_free(owner, p);
+}
 
-    // TODO: find a free block or extend heap
-    BlockHeader *alloc = find_fit(asize);
+/**
+ * Allocate a block of `asize` bytes from `arena`, with its lock held.
+ *
+ * @return pointer to the header of the allocated block or `NULL` if the heap
+ *         cannot grow
+ */
+static BlockHeader *arena_alloc(Arena *arena, int asize) {
+    BlockHeader *alloc = find_fit(arena, asize);
     if(alloc != NULL){
-        alloc = place(alloc, asize);
+        alloc = place(arena, alloc, asize);
     } else{
         int extend_heap_size = MAX(asize, 4096);
-        if ( (alloc = extend_heap(extend_heap_size)) == NULL){
+        if ( (alloc = extend_heap(arena, extend_heap_size)) == NULL){
             return NULL;
         }
-        alloc = place(alloc, asize);
+        alloc = place(arena, alloc, asize);
+    }
+    return alloc;
+}
+
+static void tcache_push(ThreadCache *tc, int cls, char *p) {
+    set_link(p, tc->head[cls]);
+    tc->head[cls] = p;
+    tc->count[cls]++;
+}
+static char *tcache_pop(ThreadCache *tc, int cls) {
+    char *p = tc->head[cls];
+    tc->head[cls] = get_link(p);
+    tc->count[cls]--;
+    return p;
+}
+
+/* Give `count` objects of a cache list back to their arenas */
+static void tcache_flush(ThreadCache *tc, int cls, int count) {
+    Arena *arena = get_arena();
+    spin_lock(&arena->lock);
+    while (count-- > 0 && tc->count[cls] > 0)
+        free_payload(arena, tcache_pop(tc, cls));
+    spin_unlock(&arena->lock);
+}
+
+/* Fill an empty cache list with up to TCACHE_BATCH objects from `arena`, with its lock held */
+static void tcache_refill(Arena *arena, ThreadCache *tc, int cls) {
+    for (int i = 0; i < TCACHE_BATCH; i++) {
+        char *p = slab_alloc(arena, cls);
+        if (p == NULL)
+            break;
+        tcache_push(tc, cls, p);
+    }
+}
+
+static void thread_exit(void *arg) { //give the cache of an exiting thread back to the arenas
+    ThreadCache *tc = arg;
+    if (tc->generation == atomic_load(&heap_generation)) {  // else the heap was reset, the objects are gone
+        for (int cls = 0; cls < TCACHE_CLASSES; cls++)
+            tcache_flush(tc, cls, tc->count[cls]);
+    }
+    if (thread_arena != NULL)
+        atomic_fetch_sub(&thread_arena->threads, 1);
+}
+static void tcache_key_create(void) {
+    pthread_key_create(&tcache_key, thread_exit);
+}
+static void register_thread(void) { //have thread_exit called when the calling thread exits
+    if (!tcache.registered) {
+        pthread_once(&tcache_key_once, tcache_key_create);
+        pthread_setspecific(tcache_key, &tcache);
+        tcache.registered = 1;
+    }
+}
+
+/* The cache of the calling thread, emptied if the heap was reset since it was filled */
+static ThreadCache *get_tcache(void) {
+    unsigned int generation = atomic_load(&heap_generation);
+    if (tcache.generation != generation) {
+        memset(tcache.count, 0, sizeof(tcache.count));
+        memset(tcache.head, 0, sizeof(tcache.head));
+        tcache.generation = generation;
+        register_thread();
+    }
+    return &tcache;
+}
+
+void *mm_malloc(size_t size) {
+    // ignore spurious requests
+    if (size == 0)
+        return NULL;
+
+    int cls = slab_class(size);
+    ThreadCache *tc = NULL;
+    if (cls >= 0) {
+        tc = get_tcache();
+        if (tc->count[cls] > 0)
+            return tcache_pop(tc, cls);
+    }
+
+    Arena *arena = get_arena();
+    spin_lock(&arena->lock);
+    drain_remote_frees(arena);
+    char *p = NULL;
+    if (tc != NULL) {
+        tcache_refill(arena, tc, cls);
+        if (tc->count[cls] > 0)
+            p = tcache_pop(tc, cls);
     }
-    return get_payload_addr(alloc);
+    if (p == NULL) {
+        // a large payload, or no slab of this size yet: a block
+        BlockHeader *alloc = arena_alloc(arena, required_block_size(size));
+        if (alloc != NULL && get_size(alloc) <= SMALL_BLOCK)
+            arena->small_blocks++;
+        p = alloc != NULL ? get_payload_addr(alloc) : NULL;
+    }
+    spin_unlock(&arena->lock);
+    return p;
+}
+
+void mm_free(void *bp) {
+    char *p = bp;
+
+    // the slab of an object in use never goes away, so it can be read without the lock
+    Slab *slab = slab_of(p);
+    if (slab != NULL) {
+        int cls = slab_class(slab->size);
+        ThreadCache *tc = get_tcache();
+        if (tc->count[cls] == TCACHE_MAX)
+            tcache_flush(tc, cls, TCACHE_BATCH);
+        tcache_push(tc, cls, p);
+        return;
+    }
+
+    Arena *arena = get_arena();
+    Arena *owner = arena_of((BlockHeader *)p - 1);
+    if (owner != arena) {
+        remote_free(owner, p);
+        return;
+    }
+    spin_lock(&arena->lock);
+    arena_free(arena, p);
+    spin_unlock(&arena->lock);
+}
+
+/**
+ * Resize the allocated block `bp` of `arena` without moving it, with the
+ * arena lock held: shrink it or grow it into a free next block. A block at
+ * the end of its arena that fits in no free block also grows by extending the
+ * heap, which saves copying it to the new end of the heap.
+ *
+ * @return 1 if the block now has at least `required_size` bytes, 0 otherwise
+ */
+static int resize_in_place(Arena *arena, BlockHeader *bp, int required_size) {
+    int old_size = get_size(bp);
+
+    if(required_size <= old_size){
+        if(old_size - required_size > 16){
+            shrink_block(arena, bp, required_size);
+        }
+        return 1;
+    }
+
+    BlockHeader *nxtptr = get_next(bp);
+
+    int available = old_size + (get_allocated(nxtptr) ? 0 : get_size(nxtptr));
+    if(available < required_size){
+        BlockHeader *last = get_allocated(nxtptr) ? nxtptr : get_next(nxtptr);
+        if(last != arena->epilogue || find_fit(arena, required_size) != NULL){
+            return 0;
+        }
+        // the new space merges with a free next block, or starts where the epilogue was;
+        // if another arena grew last, it lands in a new segment and stays free there
+        if(extend_heap(arena, required_size - available) != nxtptr){
+            return 0;
+        }
+    }
+
+    if(!get_allocated(nxtptr) && old_size + get_size(nxtptr) >= required_size){
+        int nsize = old_size + get_size(nxtptr);
+        free_list_remove(arena, nxtptr);
+        set_header(bp, nsize, 1);
+        update_next(bp);
+        if(nsize - required_size > 8){
+            shrink_block(arena, bp, required_size);
+        }
+        return 1;
+    }
+    return 0;
 }
 
 void *mm_realloc(void *ptr, size_t size) {
@@ -384,74 +1172,206 @@ void *mm_realloc(void *ptr, size_t size) {
         mm_free(ptr);
         return NULL;
 
+    }
+
+    Slab *slab = slab_of(ptr);
+    if (slab != NULL) {
+        // objects do not grow: keep the object if it is big enough, else move
+        if (size <= (size_t)slab->size)
+            return ptr;
+        void *new_ptr = mm_malloc(size);
+        if (new_ptr == NULL)
+            return NULL;
+        memcpy(new_ptr, ptr, slab->size);
+        mm_free(ptr);
+        return new_ptr;
+
     } else {
         BlockHeader *optr = (BlockHeader *)ptr - 1;
-        BlockHeader *nptr;
-        BlockHeader *nxtptr;
-
         void *new_ptr;
 
-        size_t required_size = required_block_size(size);
-        size_t nsize;
-        size_t copy_size; 
+        // keep 8 bytes of slack, so a block that keeps growing a little stays in place
+        int required_size = required_block_size(size) + 8;
+        int old_size = get_size(optr);
 
-        copy_size = get_size(optr) - 8;
+        // the block may belong to another thread's arena
+        Arena *owner = arena_of(optr);
+        spin_lock(&owner->lock);
+        int resized = resize_in_place(owner, optr, required_size);
+        if (resized)
+            owner->small_blocks += (get_size(optr) <= SMALL_BLOCK) - (old_size <= SMALL_BLOCK);
+        spin_unlock(&owner->lock);
+        if (resized)
+            return ptr;
 
-        if(required_size == copy_size){
-            return get_payload_addr(optr);
+        new_ptr = mm_malloc(size);
+        if(new_ptr == NULL){
+            return NULL;
         }
+        // the whole old payload, unless the new one is a smaller slab object
+        memcpy(new_ptr, ptr, MIN((size_t)old_size - 4, size));
+        mm_free(ptr);
 
-        if(required_size < copy_size){
-            if(copy_size - required_size <= 16){
-                return get_payload_addr(optr);
+        return new_ptr;
+    }
+}
+static int check_failed(const char *msg, void *p) { //report a heap problem for mm_check
+    printf("mm_check: %s at %p\n", msg, p);
+    return -1;
+}
+
+static int bin_contains(Arena *arena, int bin, BlockHeader *bp) { //bp is on the list or in the treap of bin
+    if (is_tree_bin(arena, bin)) {
+        BlockHeader *node = arena->seg_free_list[bin];
+        while (node != NULL && node != bp)
+            node = tree_less(bp, node) ? *tree_left(node) : *tree_right(node);
+        return node == bp;
+    }
+    for (BlockHeader *ptr = arena->seg_free_list[bin]; ptr != NULL; ptr = get_next_free(ptr)) {
+        if (ptr == bp)
+            return 1;
+    }
+    return 0;
+}
+
+static int check_tree(BlockHeader *node, BlockHeader *lo, BlockHeader *hi, int bin) { //nodes of a treap between lo and hi, or -1 if it is malformed
+    if (node == NULL)
+        return 0;
+    if (get_allocated(node) || bin_index(get_size(node)) != bin)
+        return -1;
+    if ((lo != NULL && !tree_less(lo, node)) || (hi != NULL && !tree_less(node, hi)))
+        return -1;
+    BlockHeader *left = *tree_left(node);
+    BlockHeader *right = *tree_right(node);
+    if ((left != NULL && tree_priority(left) > tree_priority(node)) ||
+            (right != NULL && tree_priority(right) > tree_priority(node)))
+        return -1;
+    int left_nodes = check_tree(left, lo, node, bin);
+    int right_nodes = check_tree(right, node, hi, bin);
+    return left_nodes < 0 || right_nodes < 0 ? -1 : 1 + left_nodes + right_nodes;
+}
+
+static int check_slab(Arena *arena, BlockHeader *bp) { //the allocated block bp holds a consistent slab of arena
+    Slab *slab = (Slab *)get_payload_addr(bp);
+    if ((uintptr_t)slab % SLAB_SIZE != 0 || get_size(bp) != SLAB_SIZE)
+        return check_failed("slab is not one aligned page", bp);
+    if (slab->arena != arena)
+        return check_failed("slab belongs to another arena", bp);
+
+    int free_objects = 0;
+    for (char *p = slab->free; p != NULL; p = get_link(p)) {
+        if (p < (char *)slab + SLAB_OBJECTS || p >= slab->unused ||
+                (p - (char *)slab - SLAB_OBJECTS) % slab->size != 0)
+            return check_failed("slab free list points outside its objects", p);
+        if (++free_objects > SLAB_SIZE / 8)
+            return check_failed("slab free list loops", slab);
+    }
+    if ((slab->unused - (char *)slab - SLAB_OBJECTS) / slab->size - free_objects != slab->used)
+        return check_failed("slab used count does not match its free list", slab);
+
+    int listed = 0;
+    for (Slab *s = arena->slabs[slab_class(slab->size)]; s != NULL; s = s->next) {
+        if (s->next != NULL && s->next->prev != s)
+            return check_failed("slab list links disagree", s);
+        listed |= s == slab;
+    }
+    if (listed == slab_full(slab))
+        return check_failed(listed ? "full slab on its list" : "slab with free objects not on its list", slab);
+    return 0;
+}
+
+/**
+ * Walk every segment and check the heap, while no other thread uses the
+ * allocator:
+ * - each header agrees with the prev-allocated and prev-mini bits of the next
+ *   block, and each payload is aligned and in the arena of its segment
+ * - free blocks have matching footers, never neighbour each other and, but
+ *   for mini blocks, are in the bin of their size
+ * - slabs hold consistent free lists and used counts, and are on the list of
+ *   their size iff they have room
+ * - bins agree with the bitmaps and block counts, and hold only the free
+ *   blocks found by the walk
+ *
+ * @return 0 if the heap is consistent, -1 after printing the first problem
+ */
+int mm_check(void) {
+    int free_blocks = 0;
+    int count = atomic_load(&num_segments);
+    for (int k = 0; k < count; k++) {
+        Arena *arena = segments[k].arena;
+        char *end = k + 1 < count ? segments[k + 1].start : (char *)mem_heap_hi() + 1;
+        if (end <= segments[k].start)
+            return check_failed("segments out of address order", segments[k].start);
+
+        BlockHeader *prologue = (BlockHeader *)(segments[k].start + 4);
+        int prev_allocated = 1;
+        int prev_mini = 1;                          // the prologue is 8 bytes
+        for (BlockHeader *bp = get_next(prologue); ; bp = get_next(bp)) {
+            if ((char *)(bp + 1) > end)
+                return check_failed("block runs past its segment", bp);
+            if (((*bp & PREV_ALLOCATED) != 0) != prev_allocated || ((*bp & PREV_MINI) != 0) != prev_mini)
+                return check_failed("prev bits disagree with the previous block", bp);
+
+            int size = get_size(bp);
+            if (size == 0) {
+                if (!get_allocated(bp))
+                    return check_failed("free epilogue", bp);
+                break;
             }
-            int req = required_size+8;
-            set_header(optr, req, 1);
-            set_footer(optr, req, 1);
-            nptr = get_next(optr);
-            int req2 = copy_size - required_size;
-            set_header(nptr, req2, 0);
-            set_footer(nptr, req2, 0);
-            free_list_insert(nptr);
-            free_coalesce(nptr);
-            return get_payload_addr(optr);
-        }
-        
-        nxtptr = get_next(optr);
-
-        if(nxtptr != NULL && !get_allocated(nxtptr)){
-            nsize = get_size(nxtptr);
-            if(nsize + copy_size >= required_size){
-                free_list_remove(nxtptr);
-                if(nsize + copy_size - required_size <= 8){
-                    int req = copy_size + 8 + nsize;
-                    set_header(optr, req, 1);
-                    set_footer(optr, req, 1);
-                    return get_payload_addr(optr);
-                }
-                else{
-                    int req = required_size + 8;
-                    set_header(optr, req, 1);
-                    set_footer(optr, req, 1);
-                    nptr = get_next(optr);
-                    int req2 = copy_size + nsize - required_size;
-                    set_header(nptr, req2, 0);
-                    set_footer(nptr, req2, 0);
-                    free_list_insert(nptr);
-                    free_coalesce(nptr);
-                    return get_payload_addr(optr);
+            if ((uintptr_t)get_payload_addr(bp) % 8 != 0)
+                return check_failed("payload not aligned to 8 bytes", bp);
+            if (arena_of(bp) != arena)
+                return check_failed("block not in the arena of its segment", bp);
+
+            if (!get_allocated(bp)) {
+                if (!prev_allocated)
+                    return check_failed("two free blocks in a row", bp);
+                if (size > MINI_BLOCK_SIZE) {
+                    BlockHeader *footer = (BlockHeader *)((char *)bp + size - 4);
+                    if (get_size(footer) != size || get_allocated(footer))
+                        return check_failed("footer disagrees with header", bp);
+                    if (!bin_contains(arena, bin_index(size), bp))
+                        return check_failed("free block not in its bin", bp);
+                    free_blocks++;
                 }
+            } else if (slab_of(get_payload_addr(bp)) != NULL && check_slab(arena, bp) < 0) {
+                return -1;
             }
+            prev_allocated = get_allocated(bp);
+            prev_mini = size == MINI_BLOCK_SIZE;
         }
+    }
 
-        new_ptr = mm_malloc(size);
-        if(new_ptr == NULL){
-            return NULL;
-        }
-        memcpy(new_ptr, ptr, copy_size);
-        mm_free(ptr);
+    int binned = 0;
+    for (int i = 0; i < NUM_ARENAS; i++) {
+        Arena *arena = &arenas[i];
+        for (int bin = 0; bin < SEGLIST_SIZE; bin++) {
+            BlockHeader *head = arena->seg_free_list[bin];
+            if ((head != NULL) != ((arena->seg_bitmap[bin / 32] >> (bin % 32)) & 1))
+                return check_failed("bitmap disagrees with bin", head);
 
-        // TODO: return pointer to payload of new block
-        return new_ptr;
+            int blocks = 0;
+            if (is_tree_bin(arena, bin)) {
+                if ((blocks = check_tree(head, NULL, NULL, bin)) < 0)
+                    return check_failed("malformed treap", head);
+                if (blocks <= TREE_MIN_BLOCKS / 2)
+                    return check_failed("treap with few blocks", head);
+            } else {
+                for (BlockHeader *ptr = head; ptr != NULL; ptr = get_next_free(ptr)) {
+                    if (get_allocated(ptr) || bin_index(get_size(ptr)) != bin)
+                        return check_failed("block in the wrong bin", ptr);
+                    if (get_next_free(ptr) != NULL && get_prev_free(get_next_free(ptr)) != ptr)
+                        return check_failed("free list links disagree", ptr);
+                    if (++blocks > TREE_MIN_BLOCKS && bin >= SMALL_BINS)
+                        return check_failed("large bin list too long", head);
+                }
+            }
+            if (bin >= SMALL_BINS && blocks != arena->large_blocks[bin - SMALL_BINS])
+                return check_failed("large bin count disagrees with its blocks", head);
+            binned += blocks;
+        }
     }
-}
\ No newline at end of file
+    if (binned != free_blocks)
+        return check_failed("bins hold blocks the walk did not find free", NULL);
+    return 0;
+}
@@ -8,4 +8,7 @@ void *mm_malloc(size_t size);
 void *mm_realloc(void *ptr, size_t size);
 void  mm_free(void *ptr);
 
+/* Check the heap while no other thread uses it: 0 if consistent, -1 otherwise */
+int   mm_check(void);
+
 #endif /* __MM_H__ */
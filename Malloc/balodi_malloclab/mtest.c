@@ -5,12 +5,16 @@
 
 #include <stdio.h>   // printf, fprintf, sprintf, stderr, EOF, FILE
 #include <stdlib.h>  // exit, free, malloc, realloc, free, atoi
+#include <limits.h>  // INT_MAX
 #include <string.h>  // memset, strdup (needs _POSIX_C_SOURCE), strncmp
 #include <assert.h>  // assert
 #include <float.h>   // DBL_MAX
 #include <time.h>    // clock_gettime, CLOCK_MONOTONIC
 #include <getopt.h>  // getopt, optarg
 #include <math.h>    // fmin
+#include <pthread.h> // pthread_create, pthread_join, pthread_barrier_t
+#include <sched.h>   // sched_yield
+#include <stdatomic.h>
 
 #define MIN(a,b) (((a)<(b))?(a):(b))
 #define MAX(a,b) (((a)>(b))?(a):(b))
@@ -258,7 +262,7 @@ static int eval_valid(malloc_f test_malloc, realloc_f test_realloc, free_f test_
 }
 
 static void replay_trace(malloc_f test_malloc, realloc_f test_realloc,
-        free_f test_free, Trace *trace) {
+        free_f test_free, Trace *trace, char **blocks) {
 
     for (int i = 0;  i < trace->num_ops;  i++) {
         switch (trace->ops[i].type) {
@@ -270,26 +274,26 @@ static void replay_trace(malloc_f test_malloc, realloc_f test_realloc,
                     printf("mm_malloc error in eval_mm_speed\n");
                     exit(1);
                 }
-                trace->blocks[index] = p;
+                blocks[index] = p;
                 break;
             }
 
             case REALLOC: {
                 int index = trace->ops[i].index;
                 int newsize = trace->ops[i].size;
-                char *oldp = trace->blocks[index];
+                char *oldp = blocks[index];
                 char *newp = test_realloc(oldp, newsize);
                 if (newp == NULL) {
                     printf("test_realloc error in eval_mm_speed\n");
                     exit(1);
                 }
-                trace->blocks[index] = newp;
+                blocks[index] = newp;
                 break;
             }
 
             case FREE: {
                 int index = trace->ops[i].index;
-                char *block = trace->blocks[index];
+                char *block = blocks[index];
                 test_free(block);
                 break;
             }
@@ -301,15 +305,76 @@ static void replay_trace(malloc_f test_malloc, realloc_f test_realloc,
     }
 }
 
+/* one thread of a multithreaded replay, with its own block pointers */
+typedef struct {
+    malloc_f test_malloc;
+    realloc_f test_realloc;
+    free_f test_free;
+    Trace *trace;
+    char **blocks;
+    int num_executions;
+    pthread_barrier_t *start;
+} ReplayThread;
+
+static void *replay_thread(void *arg) {
+    ReplayThread *rt = arg;
+    pthread_barrier_wait(rt->start);
+    for (int j = 0; j < rt->num_executions; j++) {
+        replay_trace(rt->test_malloc, rt->test_realloc, rt->test_free, rt->trace, rt->blocks);
+    }
+    return NULL;
+}
+
+/* replay the trace num_executions times on each of num_threads threads at once */
+static void replay_threads(malloc_f test_malloc, realloc_f test_realloc,
+        free_f test_free, Trace *trace, int num_executions, int num_threads,
+        struct timespec *t0) {
+    pthread_t *threads = malloc(num_threads * sizeof(pthread_t));
+    ReplayThread *args = malloc(num_threads * sizeof(ReplayThread));
+    if (threads == NULL || args == NULL) {
+        perror("malloc failed in replay_threads");
+        exit(1);
+    }
+
+    // the clock starts once every thread is ready
+    pthread_barrier_t start;
+    pthread_barrier_init(&start, NULL, num_threads + 1);
+    for (int t = 0; t < num_threads; t++) {
+        args[t] = (ReplayThread){test_malloc, test_realloc, test_free, trace,
+            malloc(trace->num_ids * sizeof(char *)), num_executions, &start};
+        if (args[t].blocks == NULL) {
+            perror("malloc failed in replay_threads");
+            exit(1);
+        }
+        if (pthread_create(&threads[t], NULL, replay_thread, &args[t]) != 0) {
+            fprintf(stderr, "pthread_create failed in replay_threads\n");
+            exit(1);
+        }
+    }
+    pthread_barrier_wait(&start);
+    clock_gettime(CLOCK_MONOTONIC, t0);
+    for (int t = 0; t < num_threads; t++) {
+        pthread_join(threads[t], NULL);
+        free(args[t].blocks);
+    }
+    pthread_barrier_destroy(&start);
+    free(threads);
+    free(args);
+}
+
 static double eval_speed(malloc_f test_malloc, realloc_f test_realloc,
-        free_f test_free, Trace *trace, int repeat_min, int num_executions) {
+        free_f test_free, Trace *trace, int repeat_min, int num_executions, int num_threads) {
     struct timespec t0;
     struct timespec t1;
     double min = DBL_MAX;
     for (int i = 0; i < repeat_min; i++) {
-        clock_gettime(CLOCK_MONOTONIC, &t0);
-        for (int j = 0; j < num_executions; j++) {
-            replay_trace(test_malloc, test_realloc, test_free, trace);
+        if (num_threads > 1) {
+            replay_threads(test_malloc, test_realloc, test_free, trace, num_executions, num_threads, &t0);
+        } else {
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            for (int j = 0; j < num_executions; j++) {
+                replay_trace(test_malloc, test_realloc, test_free, trace, trace->blocks);
+            }
         }
         clock_gettime(CLOCK_MONOTONIC, &t1);
         double elapsed = (t1.tv_sec - t0.tv_sec)*1000.0 + (t1.tv_nsec - t0.tv_nsec)/1000000.0;
@@ -335,8 +400,12 @@ typedef struct {
     double mean_tput;
 } Stats;
 
-static void print_results(char* name, Stats *stats) {
-    printf("Results for %s malloc:\n", name);
+static void print_results(char* name, Stats *stats, int num_threads) {
+    if (num_threads > 1) {
+        printf("Results for %s malloc on %d threads:\n", name, num_threads);
+    } else {
+        printf("Results for %s malloc:\n", name);
+    }
     printf("%5s%7s %5s%8s%10s%8s\n", "trace", " valid", "util", "ops", "ms", "kops/s");
     for (int i = 0; i < stats->num_traces; i++) {
         if (stats->traces[i].valid) {
@@ -358,7 +427,7 @@ static void print_results(char* name, Stats *stats) {
 }
 
 static Stats *eval(char *name, malloc_f test_malloc, realloc_f test_realloc, free_f test_free,
-        char *traces[], int traces_len, int repeat_min) {
+        char *traces[], int traces_len, int repeat_min, int num_threads) {
 
     Stats *stats = calloc(1, sizeof(Stats));
     if (stats == NULL) {
@@ -379,7 +448,7 @@ static Stats *eval(char *name, malloc_f test_malloc, realloc_f test_realloc, fre
     for (int i = 0; i < traces_len; i++) {
         if (strncmp(name, "mm", 2) == 0) {
             if (i == 0) {
-                mem_init();
+                mem_init_threads(num_threads);
             }
             mem_reset_brk();
             if (mm_init() < 0) {
@@ -390,7 +459,7 @@ static Stats *eval(char *name, malloc_f test_malloc, realloc_f test_realloc, fre
         }
 
         Trace *trace = read_trace(traces[i]);
-        stats->traces[i].ops = trace->num_ops;
+        stats->traces[i].ops = (double)trace->num_ops * num_threads;  // every thread replays all ops
         stats->total_ops += stats->traces[i].ops;
 
         int max_total_size = eval_valid(test_malloc, test_realloc, test_free, trace, i);
@@ -406,7 +475,7 @@ static Stats *eval(char *name, malloc_f test_malloc, realloc_f test_realloc, fre
                     exit(1);
                 }
             }
-            stats->traces[i].ms = eval_speed(test_malloc, test_realloc, test_free, trace, repeat_min, 10);
+            stats->traces[i].ms = eval_speed(test_malloc, test_realloc, test_free, trace, repeat_min, 10, num_threads);
             stats->total_ms += stats->traces[i].ms;
         }
 
@@ -415,19 +484,294 @@ static Stats *eval(char *name, malloc_f test_malloc, realloc_f test_realloc, fre
 
     stats->mean_util /= traces_len;
     stats->mean_tput = stats->total_ops / stats->total_ms;
-    print_results(name, stats);
+    print_results(name, stats, num_threads);
     return stats;
 }
 
+/* producer/consumer benchmark: every block is allocated on one thread and freed on another */
+#define PC_BLOCKS 100000  // blocks each producer hands to its consumer
+#define PC_QUEUE 256      // slots in the queue between a producer and its consumer
+#define PC_MAX_THREADS 64
+#define PC_PAIR_HEAP (4*(1<<20))  // heap per pair, a few times a full queue of the largest blocks
+
+static const int pc_sizes[] = {16, 24, 40, 64, 100, 200, 448, 1000, 4000};
+
+typedef struct {
+    malloc_f test_malloc;
+    free_f test_free;
+    pthread_barrier_t *start;
+    char *slots[PC_QUEUE];
+    _Alignas(64) atomic_int head;  // blocks pushed by the producer
+    _Alignas(64) atomic_int tail;  // blocks freed by the consumer
+} PcQueue;
+
+static void *pc_producer(void *arg) {
+    PcQueue *q = arg;
+    int num_sizes = sizeof(pc_sizes) / sizeof(pc_sizes[0]);
+    pthread_barrier_wait(q->start);
+    for (int i = 0; i < PC_BLOCKS; i++) {
+        char *p = q->test_malloc(pc_sizes[i % num_sizes]);
+        if (p == NULL) {
+            printf("malloc error in pc_producer\n");
+            exit(1);
+        }
+        p[0] = (char)i;
+        while (i - atomic_load_explicit(&q->tail, memory_order_acquire) == PC_QUEUE)
+            sched_yield();  // queue full
+        q->slots[i % PC_QUEUE] = p;
+        atomic_store_explicit(&q->head, i + 1, memory_order_release);
+    }
+    return NULL;
+}
+
+static void *pc_consumer(void *arg) {
+    PcQueue *q = arg;
+    pthread_barrier_wait(q->start);
+    for (int i = 0; i < PC_BLOCKS; i++) {
+        while (atomic_load_explicit(&q->head, memory_order_acquire) == i)
+            sched_yield();  // queue empty
+        q->test_free(q->slots[i % PC_QUEUE]);
+        atomic_store_explicit(&q->tail, i + 1, memory_order_release);
+    }
+    return NULL;
+}
+
+/* run num_threads/2 producer/consumer pairs at once, return the elapsed ms */
+static double run_producer_consumer(malloc_f test_malloc, free_f test_free, int num_threads) {
+    int pairs = num_threads / 2;
+    pthread_t *threads = malloc(2 * pairs * sizeof(pthread_t));
+    PcQueue *queues = calloc(pairs, sizeof(PcQueue));
+    if (threads == NULL || queues == NULL) {
+        perror("malloc failed in run_producer_consumer");
+        exit(1);
+    }
+
+    pthread_barrier_t start;
+    pthread_barrier_init(&start, NULL, 2 * pairs + 1);
+    for (int i = 0; i < pairs; i++) {
+        queues[i].test_malloc = test_malloc;
+        queues[i].test_free = test_free;
+        queues[i].start = &start;
+        if (pthread_create(&threads[2*i], NULL, pc_producer, &queues[i]) != 0 ||
+                pthread_create(&threads[2*i + 1], NULL, pc_consumer, &queues[i]) != 0) {
+            fprintf(stderr, "pthread_create failed in run_producer_consumer\n");
+            exit(1);
+        }
+    }
+
+    struct timespec t0;
+    struct timespec t1;
+    pthread_barrier_wait(&start);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int i = 0; i < 2 * pairs; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    pthread_barrier_destroy(&start);
+    free(threads);
+    free(queues);
+    return (t1.tv_sec - t0.tv_sec)*1000.0 + (t1.tv_nsec - t0.tv_nsec)/1000000.0;
+}
+
+static void eval_producer_consumer(char *name, malloc_f test_malloc, free_f test_free,
+        int max_threads, int repeat_min) {
+    printf("Producer/consumer results for %s malloc:\n", name);
+    printf("%7s%10s%10s%8s\n", "threads", "ops", "ms", "kops/s");
+    for (int num_threads = 2; num_threads <= max_threads; num_threads *= 2) {
+        double min = DBL_MAX;
+        for (int i = 0; i < repeat_min; i++) {
+            if (strncmp(name, "mm", 2) == 0) {
+                mem_reset_brk();
+                if (mm_init() < 0) {
+                    printf("mm_init failed in eval_producer_consumer\n");
+                    exit(1);
+                }
+            }
+            min = fmin(min, run_producer_consumer(test_malloc, test_free, num_threads));
+        }
+        double ops = 2.0 * PC_BLOCKS * (num_threads / 2);  // a malloc and a free per block
+        printf("%7d%10.0f%10.2f%8.0f\n", num_threads, ops, min, ops / min);
+    }
+    printf("\n");
+}
+
+/* heap check: random mallocs, reallocs and frees on several threads, checked between rounds */
+#define CHECK_ROUNDS 4
+#define CHECK_OPS 50000      // operations of each thread per round
+#define CHECK_SLOTS 256      // blocks a thread holds at most
+#define CHECK_MAILBOXES 64   // blocks on their way from one thread to another
+
+typedef struct {
+    int id;
+    unsigned int seed;
+    char *slots[CHECK_SLOTS];  // kept across rounds, so a later thread frees them
+    int errors;
+} CheckThread;
+
+static char *_Atomic check_mailboxes[CHECK_MAILBOXES];
+
+static unsigned int check_random(unsigned int *seed) {
+    *seed = *seed * 1103515245u + 12345u;
+    return *seed >> 8;
+}
+
+/* mostly slab and tcache sizes, some mid-size blocks and a few large ones */
+static int check_size(unsigned int *seed) {
+    unsigned int r = check_random(seed) % 100;
+    if (r < 60)
+        return 4 + check_random(seed) % 125;
+    if (r < 90)
+        return 4 + check_random(seed) % 1000;
+    return 4 + check_random(seed) % 20000;
+}
+
+/* a block starts with its size, then a pattern that depends on it */
+static void check_fill(char *p, int size) {
+    *(int *)p = size;
+    for (int i = 4; i < size; i++)
+        p[i] = (char)(size + i);
+}
+
+static int check_payload(CheckThread *ct, char *p, int upto) {
+    int size = *(int *)p;
+    for (int i = 4; i < MIN(size, upto); i++) {
+        if (p[i] != (char)(size + i)) {
+            printf("ERROR [check thread %d]: payload %p of %d bytes overwritten at byte %d\n", ct->id, p, size, i);
+            ct->errors++;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void *check_thread(void *arg) {
+    CheckThread *ct = arg;
+    for (int op = 0; op < CHECK_OPS && ct->errors == 0; op++) {
+        int i = check_random(&ct->seed) % CHECK_SLOTS;
+        unsigned int action = check_random(&ct->seed) % 10;
+        char *p = ct->slots[i];
+        if (p == NULL) {
+            int size = check_size(&ct->seed);
+            if ((p = mm_malloc(size)) == NULL) {
+                printf("ERROR [check thread %d]: mm_malloc failed\n", ct->id);
+                ct->errors++;
+                break;
+            }
+            check_fill(p, size);
+            ct->slots[i] = p;
+        } else if (action < 5) {            // free it here
+            check_payload(ct, p, INT_MAX);
+            mm_free(p);
+            ct->slots[i] = NULL;
+        } else if (action < 7) {            // resize it
+            int size = check_size(&ct->seed);
+            int old_size = *(int *)p;
+            char *newp = mm_realloc(p, size);
+            if (newp == NULL) {
+                printf("ERROR [check thread %d]: mm_realloc failed\n", ct->id);
+                ct->errors++;
+                break;
+            }
+            check_payload(ct, newp, MIN(size, old_size));
+            check_fill(newp, size);
+            ct->slots[i] = newp;
+        } else {                            // swap it for a block of another thread
+            check_payload(ct, p, INT_MAX);
+            int box = check_random(&ct->seed) % CHECK_MAILBOXES;
+            char *other = atomic_exchange(&check_mailboxes[box], p);
+            if (other != NULL)
+                check_payload(ct, other, INT_MAX);
+            ct->slots[i] = other;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Run CHECK_ROUNDS rounds of num_threads threads doing random mallocs,
+ * reallocs and frees, and check the heap with mm_check after each round.
+ * Every payload carries a pattern that is checked before it is freed or
+ * resized. Threads swap blocks through mailboxes, so blocks are freed by
+ * other threads than the ones that allocated them, and each round starts new
+ * threads that free the blocks left by the previous ones.
+ *
+ * @return the number of errors
+ */
+static int eval_check(int num_threads) {
+    CheckThread *cts = calloc(num_threads, sizeof(CheckThread));
+    pthread_t *threads = malloc(num_threads * sizeof(pthread_t));
+    if (cts == NULL || threads == NULL) {
+        perror("malloc failed in eval_check");
+        exit(1);
+    }
+    mem_reset_brk();
+    if (mm_init() < 0) {
+        printf("mm_init failed in eval_check\n");
+        exit(1);
+    }
+
+    int num_errors = 0;
+    for (int round = 0; round < CHECK_ROUNDS && num_errors == 0; round++) {
+        for (int t = 0; t < num_threads; t++) {
+            cts[t].id = t;
+            cts[t].seed = 7919 * (round * num_threads + t) + 1;
+            if (pthread_create(&threads[t], NULL, check_thread, &cts[t]) != 0) {
+                fprintf(stderr, "pthread_create failed in eval_check\n");
+                exit(1);
+            }
+        }
+        for (int t = 0; t < num_threads; t++) {
+            pthread_join(threads[t], NULL);
+            num_errors += cts[t].errors;
+        }
+        if (num_errors == 0 && mm_check() < 0)
+            num_errors++;
+        printf("round %d: %d threads, %d ops, heap %zu bytes, %s\n", round, num_threads,
+            num_threads * CHECK_OPS, mem_heapsize(), num_errors == 0 ? "ok" : "FAILED");
+    }
+
+    // free what is left, here, and check the heap once more
+    if (num_errors == 0) {
+        for (int t = 0; t < num_threads; t++) {
+            for (int i = 0; i < CHECK_SLOTS; i++) {
+                if (cts[t].slots[i] != NULL) {
+                    check_payload(&cts[t], cts[t].slots[i], INT_MAX);
+                    mm_free(cts[t].slots[i]);
+                }
+            }
+            num_errors += cts[t].errors;
+        }
+        for (int box = 0; box < CHECK_MAILBOXES; box++) {
+            char *p = atomic_exchange(&check_mailboxes[box], NULL);
+            if (p != NULL)
+                mm_free(p);
+        }
+        if (mm_check() < 0)
+            num_errors++;
+    }
+    printf("Heap check on %d threads: %s\n\n", num_threads, num_errors == 0 ? "passed" : "FAILED");
+
+    free(cts);
+    free(threads);
+    return num_errors;
+}
+
 static void usage(void) {
-    fprintf(stderr, "Usage: mtest [-h] [-r <reps>] [-f <file>]\nwhere\n");
+    fprintf(stderr, "Usage: mtest [-h] [-r <reps>] [-T <threads>] [-P <threads>] [-C <threads>] [-f <file>]\nwhere\n");
     fprintf(stderr, "-h         Print program usage.\n");
     fprintf(stderr, "-r <reps>  Repeat measurements <reps> times. (default: 3)\n");
+    fprintf(stderr, "-T <threads> Replay each trace on <threads> threads at once. (default: 1, at most %d)\n", MAX_HEAP_THREADS);
+    fprintf(stderr, "-P <threads> Run the producer/consumer benchmark on 2, 4, ... up to <threads> threads. (at most %d)\n", PC_MAX_THREADS);
+    fprintf(stderr, "-C <threads> Check the heap after random mallocs, reallocs and frees on <threads> threads. (at most %d)\n", MAX_HEAP_THREADS);
     fprintf(stderr, "-t <trace> Use only <trace> as the trace file.\n");
 }
 
 int main(int argc, char **argv) {
     int repeat_min = 3;
+    int num_threads = 1;
+    int pc_threads = 0;
+    int check_threads = 0;
     int traces_len = 11;
     char *traces[] = {
         "./traces/amptjp-bal.rep",
@@ -444,7 +788,7 @@ int main(int argc, char **argv) {
     };
 
     char c;
-    while ((c = getopt(argc, argv, "f:r:h")) != EOF) {
+    while ((c = getopt(argc, argv, "f:r:T:P:C:h")) != EOF) {
         switch (c) {
             case 'f':
                 traces[0] = strdup(optarg);
@@ -453,6 +797,27 @@ int main(int argc, char **argv) {
             case 'r':
                 repeat_min = atoi(optarg);
                 break;
+            case 'T':
+                num_threads = atoi(optarg);
+                if (num_threads < 1 || num_threads > MAX_HEAP_THREADS) {
+                    usage();
+                    exit(1);
+                }
+                break;
+            case 'P':
+                pc_threads = atoi(optarg);
+                if (pc_threads < 2 || pc_threads > PC_MAX_THREADS) {
+                    usage();
+                    exit(1);
+                }
+                break;
+            case 'C':
+                check_threads = atoi(optarg);
+                if (check_threads < 1 || check_threads > MAX_HEAP_THREADS) {
+                    usage();
+                    exit(1);
+                }
+                break;
             case 'h':
                 usage();
                 exit(0);
@@ -462,10 +827,22 @@ int main(int argc, char **argv) {
         }
     }
 
+    if (check_threads > 0) {
+        mem_init_threads(check_threads);
+        exit(eval_check(check_threads) == 0 ? 0 : 1);
+    }
+
+    if (pc_threads > 0) {
+        eval_producer_consumer("libc", malloc, free, pc_threads, repeat_min);
+        mem_init_region((size_t)PC_PAIR_HEAP * (pc_threads / 2));
+        eval_producer_consumer("mm", mm_malloc, mm_free, pc_threads, repeat_min);
+        exit(0);
+    }
+
     errors = 0;
-    Stats *libc_stats = eval("libc", malloc, realloc, free, traces, traces_len, repeat_min);
+    Stats *libc_stats = eval("libc", malloc, realloc, free, traces, traces_len, repeat_min, num_threads);
     errors = 0;
-    Stats *mm_stats = eval("mm", mm_malloc, mm_realloc, mm_free, traces, traces_len, repeat_min);
+    Stats *mm_stats = eval("mm", mm_malloc, mm_realloc, mm_free, traces, traces_len, repeat_min, num_threads);
 
     if (errors != 0) {
         printf("Terminated with %d errors\n", errors);